@@ -2,19 +2,32 @@
 (c) 2017-2020 Pttn (refactoring and porting to modern C++) (https://github.com/Pttn/rieMiner)
 (c) 2018 Michael Bell/Rockhawk (assembly optimizations, improvements of work management between threads, and some more) (https://github.com/MichaelBell/) */
 
+#include <immintrin.h>
+#include <ctime>
+#include <map>
+#ifndef _WIN32
+	#include <sys/resource.h>
+#endif
+#ifdef __linux__
+	#include <pthread.h>
+	#include <sched.h>
+#endif
 #include <gmpxx.h> // With Uint64_Ts, we still need to use the Mpz_ functions, otherwise there are "ambiguous overload" errors on Windows...
 
 #include "external/gmp_util.h"
-#include "ispc/fermat.h"
 #include "Miner.hpp"
 
 thread_local bool isMaster(false);
 thread_local uint64_t** offsetStack(NULL);
 thread_local uint64_t** offsetCount(NULL);
+thread_local SegmentHitsWriter** hitsWriters(NULL);
+thread_local uint32_t* sortedHits(NULL);
+thread_local int32_t localVerifyQueueIndex(-1);
+thread_local bool sieveThread(false);
 
-#define MAX_SIEVE_WORKERS 16
 #define NUM_PRIMES_TO_2P32 203280222
 #define	ZEROS_BEFORE_HASH	8
+#define EXTRACTION_WORDS 8 // Sieve words extracted (and prefiltered) at once
 
 extern "C" {
 	void rie_mod_1s_4p_cps(uint64_t *cps, uint64_t p);
@@ -23,13 +36,87 @@ extern "C" {
 	mp_limb_t rie_mod_1s_2p_8times(mp_srcptr ap, mp_size_t n, uint32_t* ps, uint32_t cnt, uint64_t* cps, uint64_t* remainders);
 }
 
+static const std::string fermatKernelNames[] = {"GMP", "Scalar", "AVX2", "AVX-512", "AVX-512 IFMA", "AVX2 ISPC", "AVX-512 ISPC"}; // By FermatKernel
 static const mpz_class mpz2(2);
 bool isPrimeFermat(const mpz_class& n) {
-	mpz_class r, nm1(n - 1);
+	static thread_local mpz_class r, nm1; // Reused to avoid allocations
+	mpz_sub_ui(nm1.get_mpz_t(), n.get_mpz_t(), 1);
 	mpz_powm(r.get_mpz_t(), mpz2.get_mpz_t(), nm1.get_mpz_t(), n.get_mpz_t());
 	return r == 1;
 }
 
+// CPU time used by the calling thread, in s
+static double threadCpuTime() {
+	timespec time;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return time.tv_sec + time.tv_nsec/1000000000.;
+}
+
+// Gives the logical CPUs usable by the process, grouped by physical core
+static std::vector<std::vector<uint64_t>> physicalCores() {
+	std::vector<std::vector<uint64_t>> cores;
+#ifdef __linux__
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	if (sched_getaffinity(0, sizeof(cpuSet), &cpuSet) != 0) return cores;
+	std::map<std::pair<int64_t, int64_t>, uint64_t> coreIndexes; // (Package, Core Id) -> Index in cores
+	for (uint64_t cpu(0) ; cpu < CPU_SETSIZE ; cpu++) {
+		if (!CPU_ISSET(cpu, &cpuSet)) continue;
+		const std::string topologyPath("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/");
+		std::ifstream coreIdFile(topologyPath + "core_id"), packageIdFile(topologyPath + "physical_package_id");
+		int64_t coreId(cpu), packageId(-1); // If the topology is unknown, each logical CPU is assumed to be a core
+		if (coreIdFile && packageIdFile) {
+			coreIdFile >> coreId;
+			packageIdFile >> packageId;
+		}
+		const std::pair<int64_t, int64_t> core(packageId, coreId);
+		if (coreIndexes.find(core) == coreIndexes.end()) {
+			coreIndexes[core] = cores.size();
+			cores.push_back(std::vector<uint64_t>());
+		}
+		cores[coreIndexes[core]].push_back(cpu);
+	}
+#endif
+	return cores;
+}
+
+void Miner::_initCpuAffinity() {
+	if (!_manager->options().cpuAffinity()) return;
+#ifdef __linux__
+	const std::vector<std::vector<uint64_t>> cores(physicalCores());
+	if (cores.size() == 0) {
+		std::cout << "Unable to get the usable CPUs, the threads will not be pinned" << std::endl;
+		return;
+	}
+	// The sieves each get a physical core, and the Fermat threads fill the other cores, then pair with the sieves on their SMT siblings, then take the remaining siblings
+	const uint64_t sieveThreads(_parameters.sieveWorkers*_parameters.sieveLanes), sieveCores(std::min(sieveThreads, (uint64_t) cores.size()));
+	_parameters.sieveCpus = _manager->options().sieveCpus();
+	if (_parameters.sieveCpus.size() == 0) {
+		for (uint64_t i(0) ; i < sieveCores ; i++)
+			_parameters.sieveCpus.push_back(cores[i][0]);
+	}
+	_parameters.fermatCpus = _manager->options().fermatCpus();
+	if (_parameters.fermatCpus.size() == 0) {
+		for (uint64_t i(sieveCores) ; i < cores.size() ; i++)
+			_parameters.fermatCpus.push_back(cores[i][0]);
+		for (uint64_t i(0) ; i < cores.size() ; i++) {
+			for (uint64_t j(1) ; j < cores[i].size() ; j++)
+				_parameters.fermatCpus.push_back(cores[i][j]);
+		}
+		if (_parameters.fermatCpus.size() == 0) // Not enough CPUs, share the ones of the sieves
+			_parameters.fermatCpus = _parameters.sieveCpus;
+	}
+	_parameters.pinThreads = true;
+	std::cout << "Sieve threads pinned to CPUs:";
+	for (const auto &cpu : _parameters.sieveCpus) std::cout << " " << cpu;
+	std::cout << std::endl << "Fermat threads pinned to CPUs:";
+	for (const auto &cpu : _parameters.fermatCpus) std::cout << " " << cpu;
+	std::cout << std::endl;
+#else
+	std::cout << "CPU Affinity is only supported on Linux, the threads will not be pinned" << std::endl;
+#endif
+}
+
 void Miner::init() {
 	_parameters.threads = _manager->options().threads();
 	_parameters.primorialOffsets = v64ToVMpz(_manager->options().primorialOffsets());
@@ -38,24 +125,46 @@ void Miner::init() {
 		_parameters.sieveWorkers = std::max(_manager->options().threads()/5, 1);
 		_parameters.sieveWorkers += (_manager->options().primeTableLimit() + 0x80000000ull) >> 33;
 	}
-	_parameters.sieveWorkers = std::min(_parameters.sieveWorkers, MAX_SIEVE_WORKERS);
 	_parameters.sieveWorkers = std::min(_parameters.sieveWorkers, int(_parameters.primorialOffsets.size()));
+	// Keep a thread for the mod and verify work, else the sieves could wait forever for room in the verify queue
+	_parameters.sieveWorkers = std::min(_parameters.sieveWorkers, _parameters.threads - 1);
 	std::cout << "Sieve Workers = " << _parameters.sieveWorkers << std::endl;
+	_parameters.sieveLanes = std::max(std::min((int) _manager->options().sieveWorkerThreads(), (_parameters.threads - 1)/_parameters.sieveWorkers), 1);
 	std::cout << "Best SIMD instructions supported:";
 	if (_cpuInfo.hasAVX512()) std::cout << " AVX-512";
-	else if (_cpuInfo.hasAVX2()) {
-		std::cout << " AVX2";
-		if (!_manager->options().enableAvx2()) std::cout << " (disabled -> AVX)";
-	}
+	else if (_cpuInfo.hasAVX2()) std::cout << " AVX2";
 	else if (_cpuInfo.hasAVX()) std::cout << " AVX";
 	else std::cout << " AVX not suppported!";
 	std::cout << std::endl;
+	// Take the best supported kernel, unless a lower one was chosen
+	const std::string fermatKernel(_manager->options().fermatKernel());
+	if (_cpuInfo.hasAVX512() && fermatKernel == "AVX-512 ISPC") _parameters.fermatKernel = FERMAT_AVX512_ISPC;
+	else if (_cpuInfo.hasAVX2() && (fermatKernel == "AVX-512 ISPC" || fermatKernel == "AVX2 ISPC")) _parameters.fermatKernel = FERMAT_AVX2_ISPC;
+	else if (_cpuInfo.hasAVX512IFMA() && (fermatKernel == "Auto" || fermatKernel == "AVX-512 IFMA")) _parameters.fermatKernel = FERMAT_AVX512IFMA;
+	else if (_cpuInfo.hasAVX512() && (fermatKernel == "Auto" || fermatKernel == "AVX-512 IFMA" || fermatKernel == "AVX-512")) _parameters.fermatKernel = FERMAT_AVX512;
+	else if (_cpuInfo.hasAVX2() && (fermatKernel == "Auto" || fermatKernel == "AVX-512 IFMA" || fermatKernel == "AVX-512" || fermatKernel == "AVX2")) _parameters.fermatKernel = FERMAT_AVX2;
+	else if (fermatKernel == "Auto" || fermatKernel == "AVX-512 IFMA" || fermatKernel == "AVX-512" || fermatKernel == "AVX2" || fermatKernel == "Scalar") _parameters.fermatKernel = FERMAT_SCALAR;
+	else _parameters.fermatKernel = FERMAT_GMP;
+	if (fermatKernel != "Auto" && fermatKernel != "AVX-512 IFMA" && fermatKernel != "AVX-512" && fermatKernel != "AVX2" && fermatKernel != "Scalar" && fermatKernel != "AVX-512 ISPC" && fermatKernel != "AVX2 ISPC" && fermatKernel != "GMP")
+		std::cout << "Unknown Fermat Kernel " << fermatKernel << ", using GMP" << std::endl;
+	std::cout << "Fermat Kernel: " << fermatKernelNames[_parameters.fermatKernel] << std::endl;
 	_parameters.sieveBits = _manager->options().sieveBits();
 	_parameters.sieveSize = 1 << _parameters.sieveBits;
 	_parameters.sieveWords = _parameters.sieveSize/64;
 	_parameters.maxIter = _parameters.maxIncrements/_parameters.sieveSize;
+	// All the lanes must get segments
+	_parameters.sieveLanes = std::min((uint64_t) _parameters.sieveLanes, _parameters.maxIter);
+	_parameters.sieveLanes = (_parameters.maxIter + _segmentsPerLane() - 1)/_segmentsPerLane();
+	if (_parameters.sieveLanes > 1) std::cout << "Threads per Sieve Worker = " << _parameters.sieveLanes << std::endl;
+	_initCpuAffinity();
+	_parameters.hitsBucketBits = std::min(_parameters.sieveBits, (uint64_t) _manager->options().sieveSliceBits());
+	_parameters.hitsBuckets = _parameters.maxIncrements >> _parameters.hitsBucketBits;
 	_parameters.solo = !(_manager->options().mode() == "Pool");
+	_parameters.fusedSieve = _manager->options().fusedSieve();
 	_parameters.tupleLengthMin = _manager->options().tupleLengthMin();
+	_parameters.confirmTuples = _parameters.solo && _manager->options().confirmTuples();
+	if (_parameters.confirmTuples)
+		std::cout << "The tuples will be confirmed with BPSW before being submitted" << std::endl;
 	_parameters.primeTableLimit = _manager->options().primeTableLimit();
 	_parameters.primorialNumber  = _manager->options().primorialNumber();
 	_parameters.primeTupleOffset = _manager->options().constellationType();
@@ -65,7 +174,10 @@ void Miner::init() {
 		double ptlM(((double) _parameters.primeTableLimit)/1048576.), baseMemUsage(1.68*std::pow(ptlM, 0.954)), sieveWorkerMemUsage, memUsage;
 		if (ptlM < 768.) sieveWorkerMemUsage = 1.26*ptlM + 16.;
 		else sieveWorkerMemUsage = 560.*std::log(ptlM) - 2780.;
-		memUsage = baseMemUsage + ((double) _parameters.sieveWorkers)*sieveWorkerMemUsage;
+		memUsage = baseMemUsage + ((double) _parameters.sieveWorkers*_parameters.sieveLanes)*sieveWorkerMemUsage;
+		// Each thread writes the segment hits for each Sieve Worker in its own pool, which can have a partially filled block per bucket and an unused growth
+		const double hitsWriterMemUsage(((double) (_parameters.hitsBuckets + SEGMENT_HITS_POOL_CHUNK)*sizeof(SegmentHitsBlock))/1048576.);
+		memUsage += ((double) _parameters.threads*_parameters.sieveWorkers)*hitsWriterMemUsage;
 		if (memUsage < 128.) std::cout << "Estimated memory usage: < 128 MiB" << std::endl;
 		else std::cout << "Estimated memory usage: " << memUsage << " MiB" << std::endl;
 		std::cout << "Reduce prime table limit to lower this, if needed." << std::endl;
@@ -76,6 +188,13 @@ void Miner::init() {
 	               _parameters.primeTupleOffset.end(),
 	               std::back_inserter(_halfPrimeTupleOffset),
 	               [](uint64_t n) {/*assert(n <= 6); */return n >> 1;});
+	_tupleElementOffsets = std::vector<uint64_t>(1, 0);
+	for (std::vector<uint64_t>::size_type i(1) ; i < _parameters.primeTupleOffset.size() ; i++)
+		_tupleElementOffsets.push_back(_tupleElementOffsets.back() + _parameters.primeTupleOffset[i]);
+	if (_parameters.confirmTuples) // Needs the tuple offsets
+		_confirmationThreadHandle = std::thread(&Miner::_confirmationThread, this);
+	for (uint32_t i(0) ; i < WORK_DATAS ; i++)
+		_workData[i].followUps = std::vector<std::vector<FollowUp>>(_parameters.primeTupleOffset.size());
 	_primorialOffsetDiff.resize(_parameters.sieveWorkers - 1);
 	_primorialOffsetDiffToFirst.resize(_parameters.sieveWorkers);
 	_primorialOffsetDiffToFirst[0] = 0;
@@ -108,6 +227,7 @@ void Miner::init() {
 	for (uint64_t i(1) ; i < _parameters.primorialNumber ; i++)
 		mpz_mul_ui(_primorial.get_mpz_t(), _primorial.get_mpz_t(), _parameters.primes[i]);
 	std::cout << "Primorial has " << mpz_sizeinbase(_primorial.get_mpz_t(), 2) << " binary digits" << std::endl;
+	if (_manager->options().prefilterPrimes() > 0) _initPrefilter();
 	const uint64_t precompPrimes(std::min(_nPrimes, 5586502348UL)); // Precomputation only works up to p = 2^37
 	std::cout << "Precomputing division data..." << std::endl;
 	_parameters.inverts.resize(_nPrimes);
@@ -131,118 +251,267 @@ void Miner::init() {
 	}
 	for (int16_t j(0) ; j < _parameters.threads ; j++) threads[j].join();
 	
-	uint64_t highSegmentEntries(0);
-	double highFloats(0.), tupleSizeAsDouble(_parameters.primeTupleOffset.size());
 	_primeTestStoreOffsetsSize = 0;
 	_sparseLimit = 0;
 	for (uint64_t i(5) ; i < _nPrimes ; i++) {
 		const uint64_t p(_parameters.primes[i]);
 		if (p < _parameters.maxIncrements) _primeTestStoreOffsetsSize++;
-		else {
-			if (_sparseLimit == 0) _sparseLimit = i & (~1ull);
-			highFloats += ((tupleSizeAsDouble*_parameters.maxIncrements)/(double) p);
-		}
+		else if (_sparseLimit == 0) _sparseLimit = i & (~1ull);
 	}
 	if (_sparseLimit == 0) {
 		_nPrimes &= (~1ull);
 		_sparseLimit = _nPrimes;
 	}
+	// The offsets of the primes below 2^16 are always smaller than 2^16 between two sieve iterations, so store them in 16 bits to halve the memory traffic for the most swept part of the sieve
+	_offsets16Limit = 0;
+	while (_offsets16Limit < _sparseLimit && _parameters.primes[_offsets16Limit] < 65536) _offsets16Limit++;
+	_offsets16Limit &= (~1ull);
 	
-	highSegmentEntries = ceil(highFloats);
-	if (highSegmentEntries == 0) _entriesPerSegment = 1;
-	else {
-		_entriesPerSegment = highSegmentEntries/_parameters.maxIter + 4; // Rounding up a bit
-		_entriesPerSegment = (_entriesPerSegment + (_entriesPerSegment >> 3));
-	}
 	
 	try {
 		_sieves = new SieveInstance[_parameters.sieveWorkers];
 		for (int i(0) ; i < _parameters.sieveWorkers ; i++) {
 			_sieves[i].id = i;
-			_sieves[i].segmentCounts = new std::atomic<uint64_t>[_parameters.maxIter];
+			_sieves[i].lanes = new SieveLane[_parameters.sieveLanes];
 		}
 
-		DBG(std::cout << "Allocating " << _parameters.sieveSize/8*_parameters.sieveWorkers << " bytes for the sieves..." << std::endl;);
-		for (int i(0) ; i < _parameters.sieveWorkers ; i++)
-			_sieves[i].sieve = new uint8_t[_parameters.sieveSize/8];
+		DBG(std::cout << "Allocating " << _parameters.sieveSize/8*_parameters.sieveWorkers*_parameters.sieveLanes << " bytes for the sieves..." << std::endl;);
+		for (int i(0) ; i < _parameters.sieveWorkers ; i++) {
+			for (int lane(0) ; lane < _parameters.sieveLanes ; lane++)
+				_sieves[i].lanes[lane].sieve = new uint8_t[_parameters.sieveSize/8];
+		}
 	}
 	catch (std::bad_alloc& ba) {
 		std::cerr << __func__ << ": unable to allocate memory for the miner.sieves :|..." << std::endl;
 		exit(-1);
 	}
 
-	try {
-		DBG(std::cout << "Allocating " << _parameters.primeTupleOffset.size()*4*(_primeTestStoreOffsetsSize + 1024) << " bytes for the offsets..." << std::endl;);
-		for (int i(0) ; i < _parameters.sieveWorkers ; i++)
-			_sieves[i].offsets = new uint32_t[(_primeTestStoreOffsetsSize + 1024)*_parameters.primeTupleOffset.size()];
+	// Records are indexed from the first prime stored in them, and the 32 bits ones start at _offsets16Limit
+	const uint64_t records16Size(_recordSize<uint16_t>()*(_offsets16Limit/2)), records32Size(_recordSize<uint32_t>()*((_sparseLimit - _offsets16Limit)/2));
+	DBG(std::cout << "Allocating " << (2*records16Size + 4*records32Size)*_parameters.sieveWorkers*_parameters.sieveLanes << " bytes for the primes and offsets records..." << std::endl;);
+	for (int i(0) ; i < _parameters.sieveWorkers ; i++) {
+		for (int lane(0) ; lane < _parameters.sieveLanes ; lane++) {
+			SieveLane &sieveLane(_sieves[i].lanes[lane]);
+			sieveLane.records16 = (uint16_t*) _mm_malloc(sizeof(uint16_t)*records16Size, 64);
+			sieveLane.records32 = (uint32_t*) _mm_malloc(sizeof(uint32_t)*records32Size, 64);
+			if (sieveLane.records16 == NULL || sieveLane.records32 == NULL) {
+				std::cerr << __func__ << ": unable to allocate memory for the offsets :|..." << std::endl;
+				exit(-1);
+			}
+			memset(sieveLane.records16, 0, sizeof(uint16_t)*records16Size);
+			memset(sieveLane.records32, 0, sizeof(uint32_t)*records32Size);
+			for (uint64_t j(0) ; j < _offsets16Limit ; j++)
+				_recordPrime(sieveLane.records16, j) = _parameters.primes[j];
+			for (uint64_t j(_offsets16Limit) ; j < _sparseLimit ; j++)
+				_recordPrime(sieveLane.records32, j - _offsets16Limit) = _parameters.primes[j];
+		}
 	}
-	catch (std::bad_alloc& ba) {
-		std::cerr << __func__ << ": unable to allocate memory for the offsets :|..." << std::endl;
-		exit(-1);
+
+	_localVerifyQueues.resize(_parameters.threads);
+	for (auto &localVerifyQueue : _localVerifyQueues)
+		localVerifyQueue.reset(new mpmcRing<primeTestWork, LOCAL_VERIFY_QUEUE_SIZE>());
+	
+	// Initial guess at a value for maxWorkOut
+	_maxWorkOut = std::min(_parameters.threads*32u*_parameters.sieveWorkers, _workDoneQueue.size() - 256);
+	
+	_inited = true;
+}
+
+Miner::~Miner() {
+	if (_confirmationThreadHandle.joinable()) {
+		_confirmationQueue.push_back(TupleConfirmation{WorkData(), 0, 0});
+		_confirmationThreadHandle.join();
+	}
+}
+
+void Miner::_initPrefilter() {
+	if (_tupleElementOffsets.back() >= 64) {
+		std::cout << "The prefilter only supports constellations spanning less than 64, disabling it." << std::endl;
+		return;
+	}
+	_tupleOffsetsMask = 0;
+	for (const auto &tupleElementOffset : _tupleElementOffsets)
+		_tupleOffsetsMask |= 1ULL << tupleElementOffset;
+	
+	// Sieve of Eratosthenes between the Prime Table Limit and a bound large enough to contain the wanted number of primes
+	const uint64_t wanted(_manager->options().prefilterPrimes()), start(_parameters.primeTableLimit | 1),
+	               end(start + 2*wanted*std::ceil(std::log((double) start)) + 1024);
+	if (end >= (1ULL << 32)) {
+		std::cout << "The prefilter only supports primes below 2^32, disabling it." << std::endl;
+		return;
+	}
+	std::vector<bool> composite((end - start)/2, false); // Odd numbers from start
+	for (uint64_t i(1) ; i < _nPrimes && _parameters.primes[i]*_parameters.primes[i] < end ; i++) {
+		const uint64_t p(_parameters.primes[i]);
+		uint64_t n(std::max(p*p, ((start + p - 1)/p)*p));
+		if ((n & 1) == 0) n += p;
+		for ( ; n < end ; n += 2*p) composite[(n - start)/2] = true;
+	}
+	for (uint64_t i(0) ; i < composite.size() && _prefilterPrimes.size() < wanted ; i++) {
+		if (composite[i]) continue;
+		PrefilterPrime prefilterPrime;
+		prefilterPrime.p = start + 2*i;
+		prefilterPrime.primorialResidue = mpz_fdiv_ui(_primorial.get_mpz_t(), prefilterPrime.p);
+		prefilterPrime.primorialResidueShoup = (((uint64_t) prefilterPrime.primorialResidue) << 32)/prefilterPrime.p;
+		prefilterPrime.segmentResidue = (((uint64_t) prefilterPrime.primorialResidue)*_parameters.sieveSize) % prefilterPrime.p;
+		_prefilterPrimes.push_back(prefilterPrime);
 	}
+	_prefilterOffsetResidues.resize(_parameters.sieveWorkers*_prefilterPrimes.size());
+	for (int j(0) ; j < _parameters.sieveWorkers ; j++) {
+		for (uint64_t k(0) ; k < _prefilterPrimes.size() ; k++)
+			_prefilterOffsetResidues[j*_prefilterPrimes.size() + k] = _primorialOffsetDiffToFirst[j] % _prefilterPrimes[k].p;
+	}
+	std::cout << "Prefiltering the candidates with the " << _prefilterPrimes.size() << " primes from " << _prefilterPrimes.front().p << " to " << _prefilterPrimes.back().p << std::endl;
+}
 
-	for (int i(0) ; i < _parameters.sieveWorkers ; i++)
-		memset(_sieves[i].offsets, 0, sizeof(uint32_t)*_parameters.primeTupleOffset.size()*(_primeTestStoreOffsetsSize + 1024));
+// Removes the candidates having a tuple element divisible by a prefilter prime, loopResidues being the residues of the number corresponding to the index 0
+uint32_t Miner::_prefilter(uint32_t *candidates, uint32_t n, const std::vector<uint32_t> &loopResidues) {
+	bool divisible[64*EXTRACTION_WORDS];
+	assert(n <= 64*EXTRACTION_WORDS);
+	for (uint32_t i(0) ; i < n ; i++) divisible[i] = false;
+	for (uint64_t k(0) ; k < _prefilterPrimes.size() ; k++) {
+		const uint64_t p(_prefilterPrimes[k].p), w(_prefilterPrimes[k].primorialResidue), wShoup(_prefilterPrimes[k].primorialResidueShoup), loopResidue(loopResidues[k]);
+		for (uint32_t i(0) ; i < n ; i++) { // Written so that the compiler can vectorize it
+			const uint64_t q((wShoup*candidates[i]) >> 32);
+			uint64_t r(w*candidates[i] - q*p); // Primorial*index mod p, or that + p
+			r = r >= p ? r - p : r;
+			r += loopResidue;
+			r = r >= p ? r - p : r;
+			const uint64_t negR(r == 0 ? 0 : p - r); // The number is divisible by p if it is minus an offset of the tuple mod p
+			divisible[i] |= negR < 64 && ((_tupleOffsetsMask >> negR) & 1);
+		}
+	}
+	uint32_t kept(0);
+	for (uint32_t i(0) ; i < n ; i++) {
+		if (!divisible[i]) {
+			candidates[kept] = candidates[i];
+			kept++;
+		}
+	}
+	return kept;
+}
 
+void Miner::_growSegmentHitsPool(SegmentHitsWriter& writer, uint64_t blocks) {
 	try {
-		DBG(std::cout << "Allocating " << 4*_parameters.maxIter*_entriesPerSegment << " bytes for the segment hits..." << std::endl;);
-		for (int i(0) ; i < _parameters.sieveWorkers ; i++) {
-			_sieves[i].segmentHits = new uint32_t*[_parameters.maxIter];
-			for (uint64_t j(0); j < _parameters.maxIter; j++)
-				_sieves[i].segmentHits[j] = new uint32_t[_entriesPerSegment];
-		}
+		SegmentHitsBlock *newBlocks(new SegmentHitsBlock[blocks]);
+		for (uint64_t i(0) ; i < blocks ; i++)
+			writer.pool.push_back(&newBlocks[i]);
 	}
 	catch (std::bad_alloc& ba) {
 		std::cerr << __func__ << ": unable to allocate memory for the segment hits :|..." << std::endl;
 		exit(-1);
 	}
+}
 
-	// Initial guess at a value for maxWorkOut
-	_maxWorkOut = std::min(_parameters.threads*32u*_parameters.sieveWorkers, _workDoneQueue.size() - 256);
-	
-	_inited = true;
+SegmentHitsBlock* Miner::_appendSegmentHitsBlock(SegmentHitsWriter& writer, uint64_t bucket) {
+	if (writer.poolUsed == writer.pool.size())
+		_growSegmentHitsPool(writer, SEGMENT_HITS_POOL_CHUNK);
+	SegmentHitsBlock *block(writer.pool[writer.poolUsed]);
+	writer.poolUsed++;
+	// The block may be recycled from a previous work, only its first count entries are ever read
+	block->next = NULL;
+	block->count = 0;
+	if (writer.tails[bucket] == NULL) writer.heads[bucket] = block;
+	else writer.tails[bucket]->next = block;
+	writer.tails[bucket] = block;
+	return block;
 }
 
-void Miner::_putOffsetsInSegments(SieveInstance& sieve, uint64_t *offsets, uint64_t* counts, int n_offsets) {
-	for (uint64_t segment(0) ; segment < _parameters.maxIter ; segment++) {
-		const uint64_t curSegmentCount(sieve.segmentCounts[segment].fetch_add(counts[segment])),
-		               sc(curSegmentCount + counts[segment]);
-		if (sc >= _entriesPerSegment) {
-			std::cerr << __func__ << ": segment " << segment << " " << sc << " count is > " << _entriesPerSegment << std::endl;
-			abort();
-		}
-		counts[segment] = curSegmentCount;
+void Miner::_resetSegmentHitsWriter(SegmentHitsWriter& writer) {
+	for (uint64_t bucket(0) ; bucket < _parameters.hitsBuckets ; bucket++) {
+		writer.heads[bucket] = NULL;
+		writer.tails[bucket] = NULL;
 	}
+	writer.poolUsed = 0;
+}
+
+void Miner::_putOffsetsInSegments(SegmentHitsWriter& writer, uint64_t *offsets, uint64_t* counts, int n_offsets) {
+	// Counting sort of the hits by bucket, so each bucket then gets a sequential write
+	uint64_t position(0);
+	for (uint64_t bucket(0) ; bucket < _parameters.hitsBuckets ; bucket++) {
+		const uint64_t count(counts[bucket]);
+		counts[bucket] = position;
+		position += count;
+	}
+	assert(position == (uint64_t) n_offsets); // The counts must be the ones of this batch, else the buckets would get more entries than hits
 	for (int i(0) ; i < n_offsets ; i++) {
-		const uint64_t index(offsets[i]),
-		               segment(index >> _parameters.sieveBits),
-		               sc(counts[segment]);
-		sieve.segmentHits[segment][sc] = index & (_parameters.sieveSize - 1);
-		counts[segment]++;
+		const uint64_t bucket(offsets[i] >> _parameters.hitsBucketBits);
+		sortedHits[counts[bucket]] = offsets[i] & ((1ULL << _parameters.hitsBucketBits) - 1);
+		counts[bucket]++;
+	}
+	DBG_VERIFY(({
+		uint64_t bucketStart(0);
+		for (uint64_t bucket(0) ; bucket < _parameters.hitsBuckets ; bucket++) {
+			std::vector<uint32_t> expected, sorted(&sortedHits[bucketStart], &sortedHits[counts[bucket]]);
+			for (int i(0) ; i < n_offsets ; i++) {
+				if ((offsets[i] >> _parameters.hitsBucketBits) == bucket)
+					expected.push_back(offsets[i] & ((1ULL << _parameters.hitsBucketBits) - 1));
+			}
+			if (sorted != expected) {std::cerr << "Hits sort check fail for the bucket " << bucket << std::endl; abort();}
+			bucketStart = counts[bucket];
+		}
+	}));
+	
+	// The hits are only read after all the mod work, so use non-temporal stores to not evict the useful data from the caches
+	uint64_t i(0);
+	for (uint64_t bucket(0) ; bucket < _parameters.hitsBuckets ; bucket++) {
+		const uint64_t end(counts[bucket]);
+		counts[bucket] = 0;
+		SegmentHitsBlock *block(writer.tails[bucket]);
+		while (i < end) {
+			if (block == NULL || block->count == SEGMENT_HITS_BLOCK_ENTRIES)
+				block = _appendSegmentHitsBlock(writer, bucket);
+			const uint64_t blockEnd(std::min(end, i + SEGMENT_HITS_BLOCK_ENTRIES - block->count));
+			for ( ; i < blockEnd && (block->count & 3) != 0 ; i++, block->count++)
+				block->setEntry(block->count, sortedHits[i]);
+			for ( ; i + 4 <= blockEnd ; i += 4, block->count += 4) {
+				int *words((int*) &block->entries[3*block->count]);
+				_mm_stream_si32(&words[0], sortedHits[i] | (sortedHits[i + 1] << 24));
+				_mm_stream_si32(&words[1], (sortedHits[i + 1] >> 8) | (sortedHits[i + 2] << 16));
+				_mm_stream_si32(&words[2], (sortedHits[i + 2] >> 16) | (sortedHits[i + 3] << 8));
+			}
+			for ( ; i < blockEnd ; i++, block->count++)
+				block->setEntry(block->count, sortedHits[i]);
+			assert(block->count <= SEGMENT_HITS_BLOCK_ENTRIES);
+		}
 	}
-	for (uint64_t segment(0); segment < _parameters.maxIter; segment++)
-		counts[segment] = 0;
+	assert(i == (uint64_t) n_offsets);
+	_mm_sfence();
 }
 
 void Miner::_updateRemainders(uint32_t workDataIndex, uint64_t start_i, uint64_t end_i) {
-	mpz_class tar(_workData[workDataIndex].verifyTarget);
-	tar += _workData[workDataIndex].verifyRemainderPrimorial;
-	int n_offsets[MAX_SIEVE_WORKERS] = {0};
+	const mpz_class &tar(_workData[workDataIndex].verifyBase);
+	std::vector<int> n_offsets(_parameters.sieveWorkers, 0);
 	static const int OFFSET_STACK_SIZE(16384);
-	const uint64_t tupleSize(_parameters.primeTupleOffset.size());
 	if (offsetStack == NULL) {
-		offsetStack = new uint64_t*[MAX_SIEVE_WORKERS];
-		offsetCount = new uint64_t*[MAX_SIEVE_WORKERS];
+		offsetStack = new uint64_t*[_parameters.sieveWorkers];
+		offsetCount = new uint64_t*[_parameters.sieveWorkers];
 		for (int i(0) ; i < _parameters.sieveWorkers ; ++i) {
 			offsetStack[i] = new uint64_t[OFFSET_STACK_SIZE];
-			offsetCount[i] = new uint64_t[_parameters.maxIter];
-			for (uint64_t segment(0) ; segment < _parameters.maxIter ; segment++)
-				offsetCount[i][segment] = 0;
+			offsetCount[i] = new uint64_t[_parameters.hitsBuckets];
+			for (uint64_t bucket(0) ; bucket < _parameters.hitsBuckets ; bucket++)
+				offsetCount[i][bucket] = 0;
+		}
+		sortedHits = new uint32_t[OFFSET_STACK_SIZE];
+		hitsWriters = new SegmentHitsWriter*[_parameters.sieveWorkers];
+		for (int i(0) ; i < _parameters.sieveWorkers ; ++i) {
+			hitsWriters[i] = new SegmentHitsWriter;
+			hitsWriters[i]->heads = new SegmentHitsBlock*[_parameters.hitsBuckets];
+			hitsWriters[i]->tails = new SegmentHitsBlock*[_parameters.hitsBuckets];
+			_resetSegmentHitsWriter(*hitsWriters[i]);
+			_sieves[i].hitsWritersLock.lock();
+			_sieves[i].hitsWriters.push_back(hitsWriters[i]);
+			_sieves[i].hitsWritersLock.unlock();
 		}
 	}
 
 	// On Windows, caching these thread_local pointers on the stack makes a noticeable perf difference.
 	uint64_t **offsets(offsetStack), **counts(offsetCount);
+	// A previous job may have returned in the middle of a batch because of a height change, so its counts must be discarded
+	for (int j(0) ; j < _parameters.sieveWorkers ; j++) {
+		for (uint64_t bucket(0) ; bucket < _parameters.hitsBuckets ; bucket++)
+			counts[j][bucket] = 0;
+	}
 	const uint64_t precompLimit(_parameters.modPrecompute.size());
 
 	uint64_t avxLimit(0);
@@ -328,34 +597,37 @@ void Miner::_updateRemainders(uint32_t workDataIndex, uint64_t start_i, uint64_t
 
 		// We use a macro here to ensure the compiler inlines the code, and also make it easier to early
 		// out of the function completely if the current height has changed.
+#define storeOffsets(offsets) { \
+			offsets[0] = index; \
+			for (std::vector<uint64_t>::size_type f(1) ; f < _halfPrimeTupleOffset.size() ; f++) { \
+				if (index < invert[_halfPrimeTupleOffset[f]]) index += p; \
+				index -= invert[_halfPrimeTupleOffset[f]]; \
+				offsets[f] = index; \
+			} \
+		}
 #define addToOffsets(j) { \
 			if (!onceOnly) { \
-				uint32_t* offsets = &_sieves[j].offsets[tupleSize*i]; \
-				offsets[0] = index; \
-				for (std::vector<uint64_t>::size_type f(1) ; f < _halfPrimeTupleOffset.size() ; f++) { \
-					if (index < invert[_halfPrimeTupleOffset[f]]) index += p; \
-					index -= invert[_halfPrimeTupleOffset[f]]; \
-					offsets[f] = index; \
-				} \
+				if (i < _offsets16Limit) storeOffsets(_recordOffsets(_sieves[j].lanes[0].records16, i)) \
+				else storeOffsets(_recordOffsets(_sieves[j].lanes[0].records32, i - _offsets16Limit)) \
 			} \
 			else { \
 				if (n_offsets[j] + _halfPrimeTupleOffset.size() >= OFFSET_STACK_SIZE) { \
 					if (_workData[workDataIndex].verifyBlock.height != _currentHeight) { \
 						return; \
 					} \
-					_putOffsetsInSegments(_sieves[j], offsets[j], counts[j], n_offsets[j]); \
+					_putOffsetsInSegments(*hitsWriters[j], offsets[j], counts[j], n_offsets[j]); \
 					n_offsets[j] = 0; \
 				} \
 				if (index < _parameters.maxIncrements) { \
 					offsets[j][n_offsets[j]++] = index; \
-					counts[j][index >> _parameters.sieveBits]++; \
+					counts[j][index >> _parameters.hitsBucketBits]++; \
 				} \
 				for (std::vector<uint64_t>::size_type f(1) ; f < _halfPrimeTupleOffset.size() ; f++) { \
 					if (index < invert[_halfPrimeTupleOffset[f]]) index += p; \
 					index -= invert[_halfPrimeTupleOffset[f]]; \
 					if (index < _parameters.maxIncrements) { \
 						offsets[j][n_offsets[j]++] = index; \
-						counts[j][index >> _parameters.sieveBits]++; \
+						counts[j][index >> _parameters.hitsBucketBits]++; \
 					} \
 				} \
 			} \
@@ -396,55 +668,87 @@ void Miner::_updateRemainders(uint32_t workDataIndex, uint64_t start_i, uint64_t
 	if (end_i > _sparseLimit) {
 		for (int j(0) ; j < _parameters.sieveWorkers ; j++) {
 			if (n_offsets[j] > 0) {
-				_putOffsetsInSegments(_sieves[j], offsets[j], counts[j], n_offsets[j]);
+				_putOffsetsInSegments(*hitsWriters[j], offsets[j], counts[j], n_offsets[j]);
 				n_offsets[j] = 0;
 			}
 		}
 	}
 }
 
-void Miner::_processSieve(uint8_t *sieve, uint32_t* offsets, uint64_t start_i, uint64_t end_i) {
+template <typename T> void Miner::_processSieve(uint8_t *sieve, T* records, uint64_t start_i, uint64_t end_i, uint64_t sieveSize) {
 	const uint64_t tupleSize(_parameters.primeTupleOffset.size());
 	uint32_t pending[PENDING_SIZE];
 	uint64_t pending_pos(0);
 	_initPending(pending);
 
 	for (uint64_t i(start_i) ; i < end_i ; i++) {
-		const uint32_t p(_parameters.primes[i]);
+		const uint32_t p(_recordPrime(records, i));
+		T* const offsets(_recordOffsets(records, i));
 		for (uint64_t f(0) ; f < tupleSize; f++) {
-			while (offsets[i*tupleSize + f] < _parameters.sieveSize) {
-				_addToPending(sieve, pending, pending_pos, offsets[i*tupleSize + f]);
-				offsets[i*tupleSize + f] += p;
+			uint32_t offset(offsets[f]);
+			while (offset < sieveSize) {
+				_addToPending(sieve, pending, pending_pos, offset);
+				offset += p;
 			}
-			offsets[i*tupleSize + f] -= _parameters.sieveSize;
+			offsets[f] = offset - sieveSize;
 		}
 	}
 
 	_termPending(sieve, pending);
 }
 
-void Miner::_processSieve6(uint8_t *sieve, uint32_t* offsets, uint64_t start_i, uint64_t end_i) {
+// Loads the 12 offsets and the 2 primes of a 6-tuples record as 32 bits lanes, and stores back the offsets
+static inline void loadRecord6(const uint32_t* record, xmmreg_t &offset1, xmmreg_t &offset2, xmmreg_t &offset3, xmmreg_t &primes) {
+	offset1.m128 = _mm_load_si128((__m128i const*) &record[0]);
+	offset2.m128 = _mm_load_si128((__m128i const*) &record[4]);
+	offset3.m128 = _mm_load_si128((__m128i const*) &record[8]);
+	primes.m128 = _mm_load_si128((__m128i const*) &record[12]);
+}
+static inline void storeRecord6(uint32_t* record, const xmmreg_t &offset1, const xmmreg_t &offset2, const xmmreg_t &offset3) {
+	_mm_store_si128((__m128i*) &record[0], offset1.m128);
+	_mm_store_si128((__m128i*) &record[4], offset2.m128);
+	_mm_store_si128((__m128i*) &record[8], offset3.m128);
+}
+static inline void loadRecord6(const uint16_t* record, xmmreg_t &offset1, xmmreg_t &offset2, xmmreg_t &offset3, xmmreg_t &primes) {
+	const __m128i zero(_mm_setzero_si128()),
+	              offsets0to7(_mm_load_si128((__m128i const*) &record[0])),
+	              offsets8to11AndPrimes(_mm_load_si128((__m128i const*) &record[8]));
+	offset1.m128 = _mm_unpacklo_epi16(offsets0to7, zero);
+	offset2.m128 = _mm_unpackhi_epi16(offsets0to7, zero);
+	offset3.m128 = _mm_unpacklo_epi16(offsets8to11AndPrimes, zero);
+	primes.m128 = _mm_unpackhi_epi16(offsets8to11AndPrimes, zero);
+}
+static inline void storeRecord6(uint16_t* record, const xmmreg_t &offset1, const xmmreg_t &offset2, const xmmreg_t &offset3) {
+	// SSE2 only has a signed saturating pack, so bias the values (all < 2^16) to the signed range and back
+	const __m128i bias32(_mm_set1_epi32(0x8000)), bias16(_mm_set1_epi16(-0x8000));
+	const __m128i offsets0to7(_mm_packs_epi32(_mm_sub_epi32(offset1.m128, bias32), _mm_sub_epi32(offset2.m128, bias32))),
+	              offsets8to11(_mm_packs_epi32(_mm_sub_epi32(offset3.m128, bias32), _mm_sub_epi32(offset3.m128, bias32)));
+	_mm_store_si128((__m128i*) &record[0], _mm_add_epi16(offsets0to7, bias16));
+	_mm_storel_epi64((__m128i*) &record[8], _mm_add_epi16(offsets8to11, bias16));
+}
+
+template <typename T> void Miner::_processSieve6(uint8_t *sieve, T* records, uint64_t start_i, uint64_t end_i, uint64_t sieveSize) {
 	assert(_parameters.primeTupleOffset.size() == 6);
+	assert(_recordSize<T>() == 16);
 	uint32_t pending[PENDING_SIZE];
 	uint64_t pending_pos(0);
 	_initPending(pending);
 
 	xmmreg_t offsetmax;
-	offsetmax.m128 = _mm_set1_epi32(_parameters.sieveSize);
+	offsetmax.m128 = _mm_set1_epi32(sieveSize);
 	
 	assert((start_i & 1) == 0);
 	assert((end_i & 1) == 0);
 
 	for (uint64_t i(start_i) ; i < end_i ; i += 2) {
-		xmmreg_t p1, p2, p3;
+		T* const record(&records[i*8]);
+		xmmreg_t primes, p1, p2, p3;
 		xmmreg_t offset1, offset2, offset3, nextIncr1, nextIncr2, nextIncr3;
 		xmmreg_t cmpres1, cmpres2, cmpres3;
-		p1.m128 = _mm_set1_epi32(_parameters.primes[i]);
-		p3.m128 = _mm_set1_epi32(_parameters.primes[i+1]);
-		p2.m128 = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(p1.m128), _mm_castsi128_ps(p3.m128), _MM_SHUFFLE(0, 0, 0, 0)));
-		offset1.m128 = _mm_load_si128((__m128i const*) &offsets[i*6 + 0]);
-		offset2.m128 = _mm_load_si128((__m128i const*) &offsets[i*6 + 4]);
-		offset3.m128 = _mm_load_si128((__m128i const*) &offsets[i*6 + 8]);
+		loadRecord6(record, offset1, offset2, offset3, primes);
+		p1.m128 = _mm_shuffle_epi32(primes.m128, _MM_SHUFFLE(0, 0, 0, 0));
+		p2.m128 = _mm_shuffle_epi32(primes.m128, _MM_SHUFFLE(1, 1, 0, 0));
+		p3.m128 = _mm_shuffle_epi32(primes.m128, _MM_SHUFFLE(1, 1, 1, 1));
 		while (true) {
 			cmpres1.m128 = _mm_cmpgt_epi32(offsetmax.m128, offset1.m128);
 			cmpres2.m128 = _mm_cmpgt_epi32(offsetmax.m128, offset2.m128);
@@ -466,118 +770,320 @@ void Miner::_processSieve6(uint8_t *sieve, uint32_t* offsets, uint64_t start_i,
 		offset1.m128 = _mm_sub_epi32(offset1.m128, offsetmax.m128);
 		offset2.m128 = _mm_sub_epi32(offset2.m128, offsetmax.m128);
 		offset3.m128 = _mm_sub_epi32(offset3.m128, offsetmax.m128);
-		_mm_store_si128((__m128i*)&offsets[i*6 + 0], offset1.m128);
-		_mm_store_si128((__m128i*)&offsets[i*6 + 4], offset2.m128);
-		_mm_store_si128((__m128i*)&offsets[i*6 + 8], offset3.m128);
+		storeRecord6(record, offset1, offset2, offset3);
 	}
 
 	_termPending(sieve, pending);
 }
 
-void Miner::_runSieve(SieveInstance& sieve, uint32_t workDataIndex) {
-	std::unique_lock<std::mutex> modLock(sieve.modLock, std::defer_lock);
-	for (uint64_t loop(0) ; loop < _parameters.maxIter ; loop++) {
+// Candidates extraction: appends the indexes of the zero bits (survivors) of the sieve words [start, end) to candidates, and returns how many were added.
+// The SIMD versions may write up to 16 entries past the last added one.
+static uint32_t extractCandidates(const uint64_t *sieve64, uint32_t start, uint32_t end, uint32_t *candidates) {
+	uint32_t n(0);
+	for (uint32_t b(start) ; b < end ; b++) {
+		uint64_t sb(~sieve64[b]);
+		while (sb != 0) {
+			candidates[n] = b*64 + __builtin_ctzll(sb);
+			n++;
+			sb &= sb - 1;
+		}
+	}
+	return n;
+}
+
+// For each byte, the positions of its set bits, packed in the bytes of an uint64_t
+struct ByteIndexesTable {
+	uint64_t entries[256];
+	ByteIndexesTable() {
+		for (uint32_t byte(0) ; byte < 256 ; byte++) {
+			entries[byte] = 0;
+			uint32_t n(0);
+			for (uint32_t bit(0) ; bit < 8 ; bit++) {
+				if (byte & (1 << bit)) {
+					entries[byte] |= ((uint64_t) bit) << (8*n);
+					n++;
+				}
+			}
+		}
+	}
+};
+static const ByteIndexesTable byteIndexesTable;
+
+__attribute__((target("avx2"))) static uint32_t extractCandidatesAVX2(const uint64_t *sieve64, uint32_t start, uint32_t end, uint32_t *candidates) {
+	uint32_t n(0);
+	for (uint32_t b(start) ; b < end ; b++) {
+		uint64_t sb(~sieve64[b]);
+		if (__builtin_popcountll(sb) <= 4) { // Usual case with large enough Prime Table Limits, where the scalar extraction is faster
+			for ( ; sb != 0 ; sb &= sb - 1, n++) candidates[n] = b*64 + __builtin_ctzll(sb);
+			continue;
+		}
+		for (uint32_t byteIndex(0) ; byteIndex < 8 ; byteIndex++) {
+			const uint32_t byte((sb >> (8*byteIndex)) & 0xFF);
+			const __m256i indexes(_mm256_cvtepu8_epi32(_mm_cvtsi64_si128(byteIndexesTable.entries[byte])));
+			_mm256_storeu_si256((__m256i*) &candidates[n], _mm256_add_epi32(indexes, _mm256_set1_epi32(b*64 + 8*byteIndex)));
+			n += __builtin_popcount(byte);
+		}
+	}
+	return n;
+}
+
+__attribute__((target("avx512f"))) static uint32_t extractCandidatesAVX512(const uint64_t *sieve64, uint32_t start, uint32_t end, uint32_t *candidates) {
+	const __m512i lanes(_mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0));
+	uint32_t n(0);
+	for (uint32_t b(start) ; b < end ; b++) {
+		uint64_t sb(~sieve64[b]);
+		if (__builtin_popcountll(sb) <= 4) {
+			for ( ; sb != 0 ; sb &= sb - 1, n++) candidates[n] = b*64 + __builtin_ctzll(sb);
+			continue;
+		}
+		for (uint32_t quarter(0) ; quarter < 4 ; quarter++) {
+			const __mmask16 mask((sb >> (16*quarter)) & 0xFFFF);
+			_mm512_mask_compressstoreu_epi32(&candidates[n], mask, _mm512_add_epi32(lanes, _mm512_set1_epi32(b*64 + 16*quarter)));
+			n += __builtin_popcount(mask);
+		}
+	}
+	return n;
+}
+
+// Moves the offsets of the given records forward by shift sieve positions
+template <typename T> void Miner::_shiftRecords(T* records, uint64_t start_i, uint64_t end_i, uint64_t shift) {
+	const uint64_t tupleSize(_parameters.primeTupleOffset.size());
+	for (uint64_t i(start_i) ; i < end_i ; i++) {
+		const uint32_t p(_recordPrime(records, i)), r(shift % p);
+		T* const offsets(_recordOffsets(records, i));
+		for (uint64_t f(0) ; f < tupleSize ; f++)
+			offsets[f] = offsets[f] >= r ? offsets[f] - r : offsets[f] + p - r;
+	}
+}
+
+void Miner::_runSieve(SieveInstance& sieve, uint32_t lane, uint32_t workDataIndex) {
+	SieveLane &sieveLane(sieve.lanes[lane]);
+	const uint64_t firstLoop(lane*_segmentsPerLane()), endLoop(std::min(firstLoop + _segmentsPerLane(), _parameters.maxIter));
+	if (_parameters.sieveLanes > 1) {
+		// The other lanes start from the first lane's offsets for the first segment, which must not be modified before they are copied
+		if (lane == 0) {
+			std::unique_lock<std::mutex> lock(sieve.lanesReadyLock);
+			while (sieve.lanesReady != _parameters.sieveLanes - 1)
+				sieve.lanesReadyCv.wait(lock);
+		}
+		else {
+			const uint64_t records16Size(_recordSize<uint16_t>()*(_offsets16Limit/2)), records32Size(_recordSize<uint32_t>()*((_sparseLimit - _offsets16Limit)/2));
+			memcpy(sieveLane.records16, sieve.lanes[0].records16, sizeof(uint16_t)*records16Size);
+			memcpy(sieveLane.records32, sieve.lanes[0].records32, sizeof(uint32_t)*records32Size);
+			{
+				std::lock_guard<std::mutex> lock(sieve.lanesReadyLock);
+				sieve.lanesReady++;
+			}
+			sieve.lanesReadyCv.notify_one();
+			const uint64_t shift(firstLoop*_parameters.sieveSize);
+			_shiftRecords(sieveLane.records16, _startingPrimeIndex, _offsets16Limit, shift);
+			_shiftRecords(sieveLane.records32, std::max(_startingPrimeIndex, _offsets16Limit) - _offsets16Limit, _sparseLimit - _offsets16Limit, shift);
+		}
+	}
+	
+	uint32_t (*extractCandidatesFunction)(const uint64_t*, uint32_t, uint32_t, uint32_t*)(extractCandidates);
+	if (_cpuInfo.hasAVX512()) extractCandidatesFunction = extractCandidatesAVX512;
+	else if (_cpuInfo.hasAVX2()) extractCandidatesFunction = extractCandidatesAVX2;
+	const uint64_t tupleSize(_parameters.primeTupleOffset.size()),
+	               bucketsPerSegment(_parameters.hitsBuckets/_parameters.maxIter),
+	               sliceSize(1ULL << _parameters.hitsBucketBits);
+	const uint32_t sliceWords(sliceSize/64);
+	std::vector<uint32_t> loopResidues(_prefilterPrimes.size());
+	for (uint64_t loop(firstLoop) ; loop < endLoop ; loop++) {
 		if (_workData[workDataIndex].verifyBlock.height != _currentHeight)
 			break;
 
-		memset(sieve.sieve, 0, _parameters.sieveSize/8);
+		memset(sieveLane.sieve, 0, _parameters.sieveSize/8);
+		for (uint64_t k(0) ; k < _prefilterPrimes.size() ; k++) {
+			const uint64_t p(_prefilterPrimes[k].p);
+			loopResidues[k] = (_workData[workDataIndex].prefilterResidues[k] + (loop*_prefilterPrimes[k].segmentResidue) % p + _prefilterOffsetResidues[sieve.id*_prefilterPrimes.size() + k]) % p;
+		}
 
 		// Align
-		const uint64_t tupleSize(_parameters.primeTupleOffset.size());
 		uint64_t start_i(_startingPrimeIndex);
 		for ( ; (start_i & 1) != 0 ; start_i++) {
-			const uint64_t pno(start_i);
-			const uint32_t p(_parameters.primes[pno]);
-			for (uint64_t f(0) ; f < tupleSize ; f++) {
-				while (sieve.offsets[pno*tupleSize + f] < _parameters.sieveSize) {
-					sieve.sieve[sieve.offsets[pno*tupleSize + f] >> 3] |= (1 << ((sieve.offsets[pno*tupleSize + f] & 7)));
-					sieve.offsets[pno*tupleSize + f] += p;
-				}
-				sieve.offsets[pno*tupleSize + f] -= _parameters.sieveSize;
-			}
+			if (start_i < _offsets16Limit) _processSieve(sieveLane.sieve, sieveLane.records16, start_i, start_i + 1, _parameters.sieveSize);
+			else _processSieve(sieveLane.sieve, sieveLane.records32, start_i - _offsets16Limit, start_i - _offsets16Limit + 1, _parameters.sieveSize);
 		}
 
-		// Main sieve
-		if (tupleSize == 6)
-			_processSieve6(sieve.sieve, sieve.offsets, start_i, _sparseLimit);
-		else
-			_processSieve(sieve.sieve, sieve.offsets, start_i, _sparseLimit);
+		// Main sieve. In the fused mode, the 16 bits records are done later slice by slice, with the rest of the work for the slice
+		const uint64_t start32_i(std::max(start_i, _offsets16Limit) - _offsets16Limit);
+		if (tupleSize == 6) {
+			if (!_parameters.fusedSieve) _processSieve6(sieveLane.sieve, sieveLane.records16, start_i, _offsets16Limit, _parameters.sieveSize);
+			_processSieve6(sieveLane.sieve, sieveLane.records32, start32_i, _sparseLimit - _offsets16Limit, _parameters.sieveSize);
+		}
+		else {
+			if (!_parameters.fusedSieve) _processSieve(sieveLane.sieve, sieveLane.records16, start_i, _offsets16Limit, _parameters.sieveSize);
+			_processSieve(sieveLane.sieve, sieveLane.records32, start32_i, _sparseLimit - _offsets16Limit, _parameters.sieveSize);
+		}
 
 		// Must now have all segments populated.
-		if (loop == 0) modLock.lock();
-
-		uint32_t pending[PENDING_SIZE];
-		_initPending(pending);
-		uint64_t pending_pos(0);
-		for (uint64_t i(0) ; i < sieve.segmentCounts[loop] ; i++)
-			_addToPending(sieve.sieve, pending, pending_pos, sieve.segmentHits[loop][i]);
-
-		_termPending(sieve.sieve, pending);
+		if (loop == firstLoop) {
+			sieve.modLock.lock();
+			sieve.modLock.unlock();
+		}
 
-		if (_workData[workDataIndex].verifyBlock.height != _currentHeight)
-			break;
+		// The buckets are slices of the segment, apply their hits in address order so the modified part of the sieve stays in the L2 cache
+		const auto applyHits([&](uint64_t bucket) {
+			uint32_t pending[PENDING_SIZE];
+			_initPending(pending);
+			uint64_t pending_pos(0);
+			const uint32_t bucketStart(bucket << _parameters.hitsBucketBits);
+			for (const SegmentHitsWriter *writer : sieve.hitsWriters) {
+				for (const SegmentHitsBlock *block(writer->heads[loop*bucketsPerSegment + bucket]) ; block != NULL ; block = block->next) {
+					for (uint32_t i(0) ; i < block->count ; i++)
+						_addToPending(sieveLane.sieve, pending, pending_pos, bucketStart + block->entry(i));
+				}
+			}
+			_termPending(sieveLane.sieve, pending);
+		});
 
 		primeTestWork w;
-		w.testWork.n_indexes = 0;
+		w.testWork.n_indexes = WORK_INDEXES;
 		w.testWork.offsetId = sieve.id;
 		w.testWork.loop = loop;
 		w.type = TYPE_CHECK;
 		w.workDataIndex = workDataIndex;
 		
-		bool stop(false);
-		uint64_t *sieve64((uint64_t*) sieve.sieve);
-		for (uint32_t b(0) ; !stop && b < _parameters.sieveWords ; b++) {
-			uint64_t sb(~sieve64[b]);
-
-			while (sb != 0) {
-				const uint32_t lowsb(__builtin_ctzll(sb)), i((b*64) + lowsb);
-				sb &= sb - 1;
-
-				w.testWork.indexes[w.testWork.n_indexes] = i;
-				w.testWork.n_indexes++;
-
-				if (w.testWork.n_indexes == WORK_INDEXES) {
+		// Extract the survivors by groups of words in a staging buffer, and send them by full jobs
+		const uint64_t *sieve64((uint64_t*) sieveLane.sieve);
+		uint32_t candidates[WORK_INDEXES + 64*EXTRACTION_WORDS + 16], nCandidates(0);
+		const auto extractSurvivors([&](uint32_t firstWord, uint32_t endWord) {
+			for (uint32_t b(firstWord) ; b < endWord ; b += EXTRACTION_WORDS) {
+				const uint32_t extracted(extractCandidatesFunction(sieve64, b, std::min(b + EXTRACTION_WORDS, endWord), &candidates[nCandidates]));
+				nCandidates += _prefilterPrimes.empty() ? extracted : _prefilter(&candidates[nCandidates], extracted, loopResidues);
+				if (nCandidates >= WORK_INDEXES) {
 					// Low overhead but still often enough
-					if (_workData[workDataIndex].verifyBlock.height != _currentHeight) {
-						stop = true;
-						break;
+					if (_workData[workDataIndex].verifyBlock.height != _currentHeight)
+						return false;
+					uint32_t sent(0);
+					for ( ; nCandidates - sent >= WORK_INDEXES ; sent += WORK_INDEXES) {
+						memcpy(w.testWork.indexes, &candidates[sent], WORK_INDEXES*sizeof(uint32_t));
+						_workData[workDataIndex].activeChecks++; // Before the push, so it cannot be decremented first
+						_pushCheckJob(w);
+						_workData[workDataIndex].outstandingTests++;
 					}
-
-					_verifyWorkQueue.push_back(w);
-					w.testWork.n_indexes = 0;
-					_workData[workDataIndex].outstandingTests++;
+					nCandidates -= sent;
+					memmove(candidates, &candidates[sent], nCandidates*sizeof(uint32_t));
 				}
 			}
+			return true;
+		});
+
+		bool stop(false);
+		if (_parameters.fusedSieve) { // Finish each slice while it is in the L2 cache
+			for (uint64_t bucket(0) ; !stop && bucket < bucketsPerSegment ; bucket++) {
+				uint8_t *slice(&sieveLane.sieve[bucket*sliceSize/8]);
+				if (tupleSize == 6) _processSieve6(slice, sieveLane.records16, start_i, _offsets16Limit, sliceSize);
+				else _processSieve(slice, sieveLane.records16, start_i, _offsets16Limit, sliceSize);
+				applyHits(bucket);
+				stop = !extractSurvivors(bucket*sliceWords, (bucket + 1)*sliceWords);
+			}
+		}
+		else {
+			for (uint64_t bucket(0) ; bucket < bucketsPerSegment ; bucket++)
+				applyHits(bucket);
+			if (_workData[workDataIndex].verifyBlock.height != _currentHeight)
+				break;
+			stop = !extractSurvivors(0, _parameters.sieveWords);
 		}
 
-		if (_workData[workDataIndex].verifyBlock.height != _currentHeight) break;
+		if (stop || _workData[workDataIndex].verifyBlock.height != _currentHeight) break;
 
-		if (w.testWork.n_indexes > 0) {
-			_verifyWorkQueue.push_back(w);
+		if (nCandidates > 0) {
+			w.testWork.n_indexes = nCandidates;
+			memcpy(w.testWork.indexes, candidates, nCandidates*sizeof(uint32_t));
+			_workData[workDataIndex].activeChecks++;
+			_pushCheckJob(w);
 			_workData[workDataIndex].outstandingTests++;
 		}
 	}
 }
 
-bool Miner::_testPrimesIspc(uint32_t indexes[WORK_INDEXES], uint32_t is_prime[WORK_INDEXES], const mpz_class &ploop, mpz_class &candidate) {
-	uint32_t M[WORK_INDEXES * MAX_N_SIZE], bits(0), N_Size;
-	uint32_t *mp(&M[0]);
-	for (uint32_t i(0); i < WORK_INDEXES; ++i) {
-		candidate = _primorial*indexes[i];
-		candidate += ploop;
+void Miner::_pushCheckJob(const primeTestWork &job) {
+	if (localVerifyQueueIndex >= 0 && _localVerifyQueues[localVerifyQueueIndex]->push(job)) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		// Wakes an idle thread up to steal the job, unless a wake-up is already pending. If the queue is full, no thread is waiting on it
+		if (_idleVerifyThreads > 0 && !_wakeUpPending.exchange(true)) {
+			primeTestWork wd;
+			wd.type = TYPE_DUMMY;
+			if (!_verifyWorkQueue.push_back_if_not_full(wd))
+				_wakeUpPending = false;
+		}
+	}
+	else _verifyWorkQueue.push_back(job);
+}
+
+// Takes a check job from the local queue, else steals one from the other threads, starting from the next ones
+bool Miner::_popCheckJob(primeTestWork &job) {
+	const uint32_t nQueues(_localVerifyQueues.size()), first(localVerifyQueueIndex >= 0 ? localVerifyQueueIndex : 0);
+	for (uint32_t i(0) ; i < nQueues ; i++) {
+		if (_localVerifyQueues[(first + i) % nQueues]->pop(job))
+			return true;
+	}
+	return false;
+}
+
+uint32_t Miner::_queuedVerifyJobs() {
+	uint32_t queuedJobs(_verifyWorkQueue.size());
+	for (const auto &localVerifyQueue : _localVerifyQueues)
+		queuedJobs += localVerifyQueue->size();
+	return queuedJobs;
+}
+
+// Gives in limbs verifyBase + Primorial*factor + offset, and returns its number of limbs. Unlike with mpz_class, there are no allocations once the buffer is large enough
+mp_size_t Miner::_candidateLimbs(std::vector<mp_limb_t> &limbs, uint32_t workDataIndex, uint64_t factor, uint64_t offset) const {
+	const mpz_srcptr base(_workData[workDataIndex].verifyBase.get_mpz_t()), primorial(_primorial.get_mpz_t());
+	const mp_size_t baseSize(base->_mp_size);
+	mp_size_t n(primorial->_mp_size);
+	limbs.resize(std::max(baseSize, n + 1) + 2);
+	limbs[n] = mpn_mul_1(limbs.data(), primorial->_mp_d, n, factor);
+	n++;
+	if (baseSize >= n) {
+		limbs[baseSize] = mpn_add(limbs.data(), base->_mp_d, baseSize, limbs.data(), n);
+		n = baseSize + 1;
+	}
+	else {
+		limbs[n] = mpn_add(limbs.data(), limbs.data(), n, base->_mp_d, baseSize);
+		n++;
+	}
+	limbs[n] = mpn_add_1(limbs.data(), limbs.data(), n, offset);
+	n++;
+	while (n > 1 && limbs[n - 1] == 0) n--;
+	return n;
+}
+
+// Gives the kernel to test numbers of N_Size 32 bits limbs, the chosen one if it supports them, else the scalar one or GMP, with a notice the first time
+FermatKernel Miner::_fermatKernelFor(uint32_t N_Size) {
+	if (fermatKernelSupports(_parameters.fermatKernel, N_Size)) return _parameters.fermatKernel;
+	const FermatKernel kernel(fermatKernelSupports(FERMAT_SCALAR, N_Size) ? FERMAT_SCALAR : FERMAT_GMP);
+	std::call_once(_fermatFallbackNotice, [&]() {
+		std::cout << "The " << fermatKernelNames[_parameters.fermatKernel] << " Fermat Kernel does not support " << 32*N_Size << " bits numbers, using the " << fermatKernelNames[kernel] << " one instead" << std::endl;
+	});
+	return kernel;
+}
 
+bool Miner::_testPrimesIspc(uint32_t workDataIndex, uint64_t loop, uint32_t offsetId, uint32_t indexes[WORK_INDEXES], uint32_t n, uint32_t is_prime[WORK_INDEXES]) {
+	static thread_local std::vector<uint32_t> M; // Too large for the stack at high Difficulties
+	static thread_local std::vector<mp_limb_t> limbs;
+	uint32_t bits(0), N_Size(0);
+	FermatKernel kernel(FERMAT_GMP);
+	for (uint32_t i(0); i < n; ++i) {
+		const mp_size_t size(_candidateLimbs(limbs, workDataIndex, loop*_parameters.sieveSize + indexes[i], _primorialOffsetDiffToFirst[offsetId]));
+		const uint32_t candidateBits(64*size - __builtin_clzll(limbs[size - 1]));
 		if (bits == 0) {
-			bits = mpz_sizeinbase(candidate.get_mpz_t(), 2);
+			bits = candidateBits;
 			N_Size = (bits >> 5) + ((bits & 0x1f) > 0);
-			if (N_Size > MAX_N_SIZE) return false;
+			kernel = _fermatKernelFor(N_Size);
+			if (kernel == FERMAT_GMP) return false;
+			M.resize(n*N_Size);
 		}
-		else assert(bits == mpz_sizeinbase(candidate.get_mpz_t(), 2));
+		else assert(bits == candidateBits);
 
-		memcpy(mp, candidate.get_mpz_t()->_mp_d, N_Size*4);
-		mp += N_Size;
+		memcpy(&M[i*N_Size], limbs.data(), N_Size*4);
 	}
 
-	fermatTest(N_Size, WORK_INDEXES, M, is_prime, _cpuInfo.hasAVX512());
+	fermatTest(N_Size, n, M.data(), is_prime, kernel);
 	return true;
 }
 
@@ -585,12 +1091,41 @@ void Miner::_verifyThread() {
 /* Check for a prime cluster. Uses the fermat test - jh's code noted that it is
 slightly faster. Could do an MR test as a follow-up, but the server can do this
 too for the one-in-a-whatever case that Fermat is wrong. */
-	mpz_class candidate, candidateOffset, ploop;
-
+	mpz_class candidate, ploop;
+
+	if (localVerifyQueueIndex < 0) {
+		const uint32_t index(_verifyThreadsRegistered++);
+		if (index < _localVerifyQueues.size()) {
+			localVerifyQueueIndex = index;
+			if (_parameters.pinThreads) {
+				const uint64_t sieveThreads(_parameters.sieveWorkers*_parameters.sieveLanes);
+				sieveThread = index < sieveThreads;
+				const uint64_t cpu(sieveThread ? _parameters.sieveCpus[index % _parameters.sieveCpus.size()] : _parameters.fermatCpus[(index - sieveThreads) % _parameters.fermatCpus.size()]);
+#ifdef __linux__
+				cpu_set_t cpuSet;
+				CPU_ZERO(&cpuSet);
+				CPU_SET(cpu, &cpuSet);
+				if (pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet) != 0)
+					std::cerr << "Unable to pin a thread to the CPU " << cpu << std::endl;
+#endif
+			}
+		}
+	}
 	while (_running) {
 		primeTestWork job;
 		if (!_modWorkQueue.pop_front_if_not_empty(job)) {
-			job = _verifyWorkQueue.pop_front();
+			if (sieveThread) job = _sieveWorkQueue.pop_front();
+			else if (!_verifyWorkQueue.pop_front_if_not_empty(job) && !_popCheckJob(job)) {
+				// Look again once registered as idle, so either a check job pushed meanwhile is found, or its producer sees this thread and wakes it
+				_idleVerifyThreads++;
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!_popCheckJob(job)) job = _verifyWorkQueue.pop_front();
+				_idleVerifyThreads--;
+			}
+		}
+		if (job.type == TYPE_DUMMY) { // The woken thread takes the check jobs in the next iterations, and the next push can wake another one
+			_wakeUpPending = false;
+			continue;
 		}
 		const auto startTime(std::chrono::high_resolution_clock::now());
 		
@@ -602,7 +1137,7 @@ too for the one-in-a-whatever case that Fermat is wrong. */
 		}
 		
 		if (job.type == TYPE_SIEVE) {
-			_runSieve(_sieves[job.sieveWork.sieveId], job.workDataIndex);
+			_runSieve(_sieves[job.sieveWork.sieveId], job.sieveWork.lane, job.workDataIndex);
 			_workDoneQueue.push_back(-1);
 			const auto dt(std::chrono::duration_cast<decltype(_sieveTime)>(std::chrono::high_resolution_clock::now() - startTime));
 			_sieveTime += dt;
@@ -610,85 +1145,59 @@ too for the one-in-a-whatever case that Fermat is wrong. */
 		}
 		
 		if (job.type == TYPE_CHECK) { // fallthrough: job.type == TYPE_CHECK
-			mpz_mul_ui(ploop.get_mpz_t(), _primorial.get_mpz_t(), job.testWork.loop*_parameters.sieveSize);
-			ploop += _workData[job.workDataIndex].verifyRemainderPrimorial;
-			ploop += _workData[job.workDataIndex].verifyTarget;
-			mpz_add_ui(ploop.get_mpz_t(), ploop.get_mpz_t(), _primorialOffsetDiffToFirst[job.testWork.offsetId]);
-
 			bool firstTestDone(false);
-			if (_cpuInfo.hasAVX2() && _manager->options().enableAvx2() && job.testWork.n_indexes == WORK_INDEXES) {
-				uint32_t isPrime[WORK_INDEXES];
-				firstTestDone = _testPrimesIspc(job.testWork.indexes, isPrime, ploop, candidate);
+			uint32_t isPrime[WORK_INDEXES];
+			if (_parameters.fermatKernel != FERMAT_GMP) {
+				firstTestDone = _testPrimesIspc(job.workDataIndex, job.testWork.loop, job.testWork.offsetId, job.testWork.indexes, job.testWork.n_indexes, isPrime);
 				if (firstTestDone) {
-					job.testWork.n_indexes = 0;
-					for (uint32_t i(0) ; i < WORK_INDEXES ; i++) {
+					for (uint32_t i(0) ; i < job.testWork.n_indexes ; i++) {
 						DBG_VERIFY(({
+							_followUpCandidate(candidate, job.workDataIndex, FollowUp{job.testWork.loop, job.testWork.offsetId, job.testWork.indexes[i], 0}, 0);
 							if (isPrimeFermat(candidate)) assert(isPrime[i]);
 							else assert(!isPrime[i]);
 						}));
 						_manager->incTupleCount(0);
-						if (isPrime[i])
-							job.testWork.indexes[job.testWork.n_indexes++] = job.testWork.indexes[i];
 					}
 				}
 			}
-
+			if (!firstTestDone) {
+				mpz_mul_ui(ploop.get_mpz_t(), _primorial.get_mpz_t(), job.testWork.loop*_parameters.sieveSize);
+				ploop += _workData[job.workDataIndex].verifyBase;
+				mpz_add_ui(ploop.get_mpz_t(), ploop.get_mpz_t(), _primorialOffsetDiffToFirst[job.testWork.offsetId]);
+			}
+			
+			// The follow ups of jobs tested with the Fermat kernel are staged to be tested by batches with it, the other ones are tested right away with GMP
+			std::vector<FollowUp> followUps;
 			for (uint32_t idx(0) ; idx < job.testWork.n_indexes ; idx++) {
 				if (_currentHeight != _workData[job.workDataIndex].verifyBlock.height) break;
-
-				uint8_t tupleLength(0);
-				candidate = _primorial*job.testWork.indexes[idx];
-				candidate += ploop;
 				
 				if (!firstTestDone) {
-					_manager->incTupleCount(tupleLength);
-					if (!isPrimeFermat(candidate)) continue;
-				}
-
-				candidateOffset = candidate - _workData[job.workDataIndex].verifyTarget; // offset = tested - target
-				
-				tupleLength++;
-				_manager->incTupleCount(tupleLength);
-				uint16_t offsetSum(0);
-				// Note start at 1 - we've already tested bias 0
-				for (std::vector<uint64_t>::size_type i(1) ; i < _parameters.primeTupleOffset.size() ; i++) {
-					offsetSum += _parameters.primeTupleOffset[i];
-					mpz_add_ui(candidate.get_mpz_t(), candidate.get_mpz_t(), _parameters.primeTupleOffset[i]);
-					if (isPrimeFermat(mpz_class(candidate))) {
-						tupleLength++;
-						_manager->incTupleCount(tupleLength);
-					}
-					else if (!_parameters.solo) {
-						int candidatesRemaining(5 - i);
-						if ((tupleLength + candidatesRemaining) < 4) break;
-					}
-					else break;
+					candidate = _primorial*job.testWork.indexes[idx];
+					candidate += ploop;
+					_manager->incTupleCount(0);
+					isPrime[idx] = isPrimeFermat(candidate);
 				}
+				if (!isPrime[idx]) continue;
 				
-				if (_parameters.solo) {
-					if (tupleLength < _parameters.tupleLengthMin) continue;
-				}
-				else if (tupleLength < 4) continue;
-	
-				// Generate nOffset and submit
-				for (uint32_t d(0) ; d < (uint32_t) std::min(32/((uint32_t) sizeof(mp_limb_t)), (uint32_t) candidateOffset.get_mpz_t()->_mp_size) ; d++)
-					*(mp_limb_t*) (_workData[job.workDataIndex].verifyBlock.bh.nOffset + d*sizeof(mp_limb_t)) = candidateOffset.get_mpz_t()->_mp_d[d];
-				_workData[job.workDataIndex].verifyBlock.primes = tupleLength;
-				if (_manager->options().mode() == "Benchmark") {
-					mpz_class n(candidate - offsetSum);
-					std::cout << "Found n = " << n << std::endl;
-					if (_manager->options().tuplesFile() != "None") {
-						_tupleFileLock.lock();
-						std::ofstream file(_manager->options().tuplesFile(), std::ios::app);
-						if (file)
-							file << static_cast<uint16_t>(tupleLength) << "-tuple: " << n << std::endl;
-						else
-							std::cerr << "Unable to write file " << _manager->options().tuplesFile() << " in order to write a tuple :|" << std::endl;
-						_tupleFileLock.unlock();
+				FollowUp followUp{job.testWork.loop, job.testWork.offsetId, job.testWork.indexes[idx], 1};
+				_manager->incTupleCount(1);
+				if (_tupleElementOffsets.size() == 1) _advanceFollowUp(job.workDataIndex, followUp, 1, false); // Nothing more to test
+				else if (firstTestDone) followUps.push_back(followUp);
+				else {
+					for (uint32_t element(1) ; element < _tupleElementOffsets.size() ; element++) {
+						_followUpCandidate(candidate, job.workDataIndex, followUp, element);
+						if (!_advanceFollowUp(job.workDataIndex, followUp, element, isPrimeFermat(candidate))) break;
 					}
 				}
-				_manager->submitWork(_workData[job.workDataIndex].verifyBlock);
 			}
+			if (followUps.size() > 0) {
+				std::lock_guard<std::mutex> lock(_workData[job.workDataIndex].followUpsLock);
+				std::vector<FollowUp> &staged(_workData[job.workDataIndex].followUps[1]);
+				staged.insert(staged.end(), followUps.begin(), followUps.end());
+			}
+			_processFollowUps(job.workDataIndex, false);
+			if (--_workData[job.workDataIndex].activeChecks == 0)
+				_processFollowUps(job.workDataIndex, true);
 			
 			_workDoneQueue.push_back(job.workDataIndex);
 			_verifyTime += std::chrono::duration_cast<decltype(_verifyTime)>(std::chrono::high_resolution_clock::now() - startTime);
@@ -696,6 +1205,181 @@ too for the one-in-a-whatever case that Fermat is wrong. */
 	}
 }
 
+// Gives the given element of the tuple of a follow up
+void Miner::_followUpCandidate(mpz_class &candidate, uint32_t workDataIndex, const FollowUp &followUp, uint32_t element) {
+	mpz_mul_ui(candidate.get_mpz_t(), _primorial.get_mpz_t(), followUp.loop*_parameters.sieveSize + followUp.index);
+	candidate += _workData[workDataIndex].verifyBase;
+	mpz_add_ui(candidate.get_mpz_t(), candidate.get_mpz_t(), _primorialOffsetDiffToFirst[followUp.offsetId] + _tupleElementOffsets[element]);
+}
+
+// Takes the result of the test of the given element, and returns true if the next one must be tested. Otherwise, the tuple is submitted if it is long enough
+bool Miner::_advanceFollowUp(uint32_t workDataIndex, FollowUp &followUp, uint32_t element, bool isPrime) {
+	if (element < _tupleElementOffsets.size()) {
+		if (isPrime) {
+			followUp.tupleLength++;
+			_manager->incTupleCount(followUp.tupleLength);
+			if (element + 1 < _tupleElementOffsets.size()) return true;
+		}
+		else if (!_parameters.solo) {
+			int candidatesRemaining(5 - element);
+			if ((followUp.tupleLength + candidatesRemaining) >= 4 && element + 1 < _tupleElementOffsets.size()) return true;
+		}
+	}
+	
+	if (_parameters.solo) {
+		if (followUp.tupleLength < _parameters.tupleLengthMin) return false;
+	}
+	else if (followUp.tupleLength < 4) return false;
+	mpz_class firstElement;
+	_followUpCandidate(firstElement, workDataIndex, followUp, 0);
+	_submitTuple(workDataIndex, firstElement, followUp.tupleLength);
+	return false;
+}
+
+// Tests the staged follow ups by batches of FOLLOW_UP_BATCH, from the deepest elements. Only the ones of the element 1 are numerous enough to fill batches quickly, the deeper ones are tested after each check job even by partial batches,
+// so the candidates that can complete a tuple do not wait for the flush (a partial batch costs a full job of the Fermat kernel, but they are rare).
+// If flushing, the remaining follow ups are tested by partial batches, from the shallowest elements as their tests can fill the deeper batches.
+void Miner::_processFollowUps(uint32_t workDataIndex, bool flush) {
+	MinerWorkData &workData(_workData[workDataIndex]);
+	std::vector<FollowUp> batch, advanced;
+	mpz_class candidate;
+	static thread_local std::vector<uint32_t> M; // Too large for the stack at high Difficulties
+	static thread_local std::vector<mp_limb_t> limbs;
+	uint32_t isPrime[FOLLOW_UP_BATCH], element(0);
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(workData.followUpsLock);
+			if (advanced.size() > 0) {
+				workData.followUps[element + 1].insert(workData.followUps[element + 1].end(), advanced.begin(), advanced.end());
+				advanced.clear();
+			}
+			if (_currentHeight != workData.verifyBlock.height) {
+				for (auto &followUps : workData.followUps) followUps.clear();
+				return;
+			}
+			element = 0;
+			for (uint32_t e(workData.followUps.size() - 1) ; e > 0 ; e--) {
+				if (workData.followUps[e].size() >= FOLLOW_UP_BATCH || (e >= 2 && workData.followUps[e].size() > 0)) {
+					element = e;
+					break;
+				}
+			}
+			if (element == 0 && flush) {
+				for (uint32_t e(1) ; e < workData.followUps.size() ; e++) {
+					if (workData.followUps[e].size() > 0) {
+						element = e;
+						break;
+					}
+				}
+			}
+			if (element == 0) return;
+			std::vector<FollowUp> &followUps(workData.followUps[element]);
+			const uint64_t n(std::min(followUps.size(), (std::vector<FollowUp>::size_type) FOLLOW_UP_BATCH));
+			batch.assign(followUps.end() - n, followUps.end());
+			followUps.resize(followUps.size() - n);
+		}
+		
+		bool batchTested(false);
+		{
+			uint32_t bits(0), N_Size(0);
+			FermatKernel kernel(FERMAT_GMP);
+			for (uint32_t i(0) ; i < batch.size() ; i++) {
+				const mp_size_t size(_candidateLimbs(limbs, workDataIndex, batch[i].loop*_parameters.sieveSize + batch[i].index, _primorialOffsetDiffToFirst[batch[i].offsetId] + _tupleElementOffsets[element]));
+				const uint32_t candidateBits(64*size - __builtin_clzll(limbs[size - 1]));
+				if (bits == 0) {
+					bits = candidateBits;
+					N_Size = (bits >> 5) + ((bits & 0x1f) > 0);
+					kernel = _fermatKernelFor(N_Size);
+					if (kernel == FERMAT_GMP) break;
+					M.resize(batch.size()*N_Size);
+				}
+				else if (bits != candidateBits) break;
+				memcpy(&M[i*N_Size], limbs.data(), N_Size*4);
+				batchTested = i + 1 == batch.size();
+			}
+			if (batchTested) {
+				fermatTest(N_Size, batch.size(), M.data(), isPrime, kernel);
+				DBG_VERIFY(({
+					for (uint32_t i(0) ; i < batch.size() ; i++) {
+						_followUpCandidate(candidate, workDataIndex, batch[i], element);
+						assert(isPrimeFermat(candidate) == (isPrime[i] != 0));
+					}
+				}));
+			}
+		}
+		if (!batchTested) {
+			for (uint32_t i(0) ; i < batch.size() ; i++) {
+				_followUpCandidate(candidate, workDataIndex, batch[i], element);
+				isPrime[i] = isPrimeFermat(candidate);
+			}
+		}
+		for (uint32_t i(0) ; i < batch.size() ; i++) {
+			if (_advanceFollowUp(workDataIndex, batch[i], element, isPrime[i]))
+				advanced.push_back(batch[i]);
+		}
+	}
+}
+
+void Miner::_submitTuple(uint32_t workDataIndex, const mpz_class &firstElement, uint8_t tupleLength) {
+	WorkData block(_workData[workDataIndex].verifyBlock);
+	const mpz_class candidateOffset(firstElement - _workData[workDataIndex].verifyTarget); // offset = tested - target
+	for (uint32_t d(0) ; d < (uint32_t) std::min(32/((uint32_t) sizeof(mp_limb_t)), (uint32_t) candidateOffset.get_mpz_t()->_mp_size) ; d++)
+		*(mp_limb_t*) (block.bh.nOffset + d*sizeof(mp_limb_t)) = candidateOffset.get_mpz_t()->_mp_d[d];
+	block.primes = tupleLength;
+	if (_parameters.confirmTuples) { // Reported and submitted by the confirmation thread if it passes
+		if (_confirmationQueue.push_back_if_not_full(TupleConfirmation{block, firstElement, tupleLength})) return;
+		std::cerr << "The confirmation queue is full, submitting the tuple without confirmation" << std::endl;
+	}
+	_reportTuple(firstElement, tupleLength);
+	_manager->submitWork(block);
+}
+
+void Miner::_reportTuple(const mpz_class &firstElement, uint8_t tupleLength) {
+	if (_manager->options().mode() == "Benchmark") {
+		std::cout << "Found n = " << firstElement << std::endl;
+		if (_manager->options().tuplesFile() != "None") {
+			_tupleFileLock.lock();
+			std::ofstream file(_manager->options().tuplesFile(), std::ios::app);
+			if (file)
+				file << static_cast<uint16_t>(tupleLength) << "-tuple: " << firstElement << std::endl;
+			else
+				std::cerr << "Unable to write file " << _manager->options().tuplesFile() << " in order to write a tuple :|" << std::endl;
+			_tupleFileLock.unlock();
+		}
+	}
+}
+
+// Confirms the found tuples with BPSW tests in a low priority thread, so the verify threads never wait for them, and submits them if they pass
+void Miner::_confirmationThread() {
+#ifndef _WIN32
+	setpriority(PRIO_PROCESS, 0, 19); // On Linux, only affects the calling thread
+#endif
+	while (true) {
+		const TupleConfirmation confirmation(_confirmationQueue.pop_front());
+		if (confirmation.tupleLength == 0) break; // Stop request
+		const double startTime(threadCpuTime());
+		mpz_class candidate;
+		uint32_t element(0);
+		// Since GMP 6.2, mpz_probab_prime_p does a BPSW test, followed by reps - 24 Miller-Rabin ones
+		for ( ; element < confirmation.tupleLength ; element++) {
+			mpz_add_ui(candidate.get_mpz_t(), confirmation.firstElement.get_mpz_t(), _tupleElementOffsets[element]);
+			if (mpz_probab_prime_p(candidate.get_mpz_t(), 24) == 0) break;
+		}
+		const double duration(1000.*(threadCpuTime() - startTime)); // CPU time, as the wall time of this low priority thread includes the preemptions
+		if (element < confirmation.tupleLength) {
+			std::cout << "Tuple element " << element << " rejected by BPSW in " << duration << " ms, not submitting n = " << confirmation.firstElement << std::endl;
+			continue;
+		}
+		std::cout << "Tuple confirmed by BPSW in " << duration << " ms" << std::endl;
+		_reportTuple(confirmation.firstElement, confirmation.tupleLength);
+		if (confirmation.block.height != _currentHeight) {
+			std::cout << "Block " << confirmation.block.height << " is outdated, not submitting the confirmed tuple" << std::endl;
+			continue;
+		}
+		_manager->submitWork(confirmation.block);
+	}
+}
+
 void Miner::_getTargetFromBlock(mpz_class &target, const WorkData &block) {
 	std::vector<uint8_t> powHash(block.bh.powHash());
 	target = 1;
@@ -724,9 +1408,15 @@ void Miner::_processOneBlock(uint32_t workDataIndex, bool isNewHeight) {
 		
 		_workData[workDataIndex].verifyTarget = target;
 		_workData[workDataIndex].verifyRemainderPrimorial = remainderPrimorial;
+		_workData[workDataIndex].verifyBase = candidate;
+		_workData[workDataIndex].prefilterResidues.resize(_prefilterPrimes.size());
+		for (uint64_t k(0) ; k < _prefilterPrimes.size() ; k++)
+			_workData[workDataIndex].prefilterResidues[k] = mpz_fdiv_ui(candidate.get_mpz_t(), _prefilterPrimes[k].p);
 		
-		for (int i(0) ; i < _parameters.sieveWorkers ; i++)
-			for (uint64_t j(0) ; j < _parameters.maxIter; j++) _sieves[i].segmentCounts[j] = 0;
+		for (int i(0) ; i < _parameters.sieveWorkers ; i++) {
+			for (SegmentHitsWriter *writer : _sieves[i].hitsWriters)
+				_resetSegmentHitsWriter(*writer);
+		}
 		
 		primeTestWork wi;
 		wi.type = TYPE_MOD;
@@ -735,14 +1425,16 @@ void Miner::_processOneBlock(uint32_t workDataIndex, bool isNewHeight) {
 		wd.type = TYPE_DUMMY;
 		int32_t nModWorkers(0), nLowModWorkers(0);
 		
-		const uint32_t curWorkOut(_verifyWorkQueue.size());
+		const uint32_t curWorkOut(_queuedVerifyJobs());
 		const uint64_t incr(_nPrimes/(_parameters.threads*8));
 		for (auto base(_startingPrimeIndex) ; base < _nPrimes ; base += incr) {
 			uint64_t lim(std::min(_nPrimes, base + incr));
 			wi.modWork.start = base;
 			wi.modWork.end = lim;
 			_modWorkQueue.push_back(wi);
-			_verifyWorkQueue.push_front(wd);  // To ensure a thread wakes up to grab the mod work.
+			// To ensure a thread wakes up to grab the mod work, without blocking if the queues are full (then no thread is waiting on them). The sieve threads also help while their sieves are not ready
+			_verifyWorkQueue.push_back_if_not_full(wd);
+			if (_parameters.pinThreads) _sieveWorkQueue.push_back_if_not_full(wd);
 			if (wi.modWork.start < _sparseLimit) nLowModWorkers++;
 			else nModWorkers++;
 		}
@@ -761,9 +1453,14 @@ void Miner::_processOneBlock(uint32_t workDataIndex, bool isNewHeight) {
 		for (int i(0); i < _parameters.sieveWorkers; ++i) {
 			wi.sieveWork.sieveId = i;
 			_sieves[i].modLock.lock();
-			_verifyWorkQueue.push_front(wi);
+			_sieves[i].lanesReady = 0;
+			for (int lane(0) ; lane < _parameters.sieveLanes ; lane++) {
+				wi.sieveWork.lane = lane;
+				if (_parameters.pinThreads) _sieveWorkQueue.push_back(wi);
+				else _verifyWorkQueue.push_front(wi); // Before the check jobs, the order between the sieve jobs does not matter
+			}
 		}
-		int nSieveWorkers(_parameters.sieveWorkers);
+		int nSieveWorkers(_parameters.sieveWorkers*_parameters.sieveLanes);
 		
 		while (nModWorkers > 0) {
 			const int64_t i(_workDoneQueue.pop_front());
@@ -773,12 +1470,12 @@ void Miner::_processOneBlock(uint32_t workDataIndex, bool isNewHeight) {
 		}
 		for (int i(0) ; i < _parameters.sieveWorkers; ++i) _sieves[i].modLock.unlock();
 
-		uint32_t minWorkOut(std::min(curWorkOut, _verifyWorkQueue.size()));
+		uint32_t minWorkOut(std::min(curWorkOut, _queuedVerifyJobs()));
 		while (nSieveWorkers > 0) {
 			const int workId(_workDoneQueue.pop_front());
 			if (workId == -1) nSieveWorkers--;
 			else _workData[workId].outstandingTests--;
-			minWorkOut = std::min(minWorkOut, _verifyWorkQueue.size());
+			minWorkOut = std::min(minWorkOut, _queuedVerifyJobs());
 		}
 
 		if (_currentHeight == _workData[workDataIndex].verifyBlock.height && !isNewHeight) {
@@ -5,6 +5,7 @@
 
 #include <atomic>
 #include <cassert>
+#include "ispc/fermat.h"
 #include "tsQueue.hpp"
 #include "WorkManager.hpp"
 
@@ -21,6 +22,9 @@ union xmmreg_t {
 
 #define WORK_DATAS 2
 #define WORK_INDEXES 64
+#define FOLLOW_UP_BATCH 16 // Job size of the Fermat kernel
+#define CONFIRMATION_QUEUE_SIZE 64
+#define LOCAL_VERIFY_QUEUE_SIZE 1024 // Check jobs per verify thread, more go to the global queue
 enum JobType {TYPE_CHECK, TYPE_MOD, TYPE_SIEVE, TYPE_DUMMY};
 
 inline std::vector<mpz_class> v64ToVMpz(std::vector<uint64_t> v64) {
@@ -37,19 +41,24 @@ struct MinerParameters {
 	int16_t threads;
 	uint8_t tupleLengthMin;
 	uint64_t primorialNumber, primeTableLimit;
-	bool solo;
-	int sieveWorkers;
+	bool solo, fusedSieve, confirmTuples, pinThreads;
+	FermatKernel fermatKernel;
+	int sieveWorkers, sieveLanes;
 	uint64_t sieveBits, sieveSize, sieveWords, maxIncrements, maxIter;
+	uint64_t hitsBucketBits, hitsBuckets; // The segment hits are stored by buckets of 2^hitsBucketBits sieve positions, which are cache sized slices of the segments
 	std::vector<uint64_t> primes, inverts, modPrecompute, primeTupleOffset;
+	std::vector<uint64_t> sieveCpus, fermatCpus; // If pinThreads, the first sieveWorkers*sieveLanes verify threads only run the sieves and help with the mod work
 	std::vector<mpz_class> primorialOffsets;
 	
 	MinerParameters() :
 		threads(8),
 		tupleLengthMin(6),
 		primorialNumber(40), primeTableLimit(2147483648),
-		solo(true),
-		sieveWorkers(2),
+		solo(true), fusedSieve(false), confirmTuples(false), pinThreads(false),
+		fermatKernel(FERMAT_GMP),
+		sieveWorkers(2), sieveLanes(1),
 		sieveBits(25), sieveSize(1UL << sieveBits), sieveWords(sieveSize/64), maxIncrements(1ULL << 29), maxIter(maxIncrements/sieveSize),
+		hitsBucketBits(21), hitsBuckets(maxIncrements >> hitsBucketBits),
 		primeTupleOffset(defaultConstellationData[0].first),
 		primorialOffsets(v64ToVMpz(defaultConstellationData[0].second)) {}
 };
@@ -70,23 +79,85 @@ struct primeTestWork {
 		} modWork;
 		struct {
 			uint32_t sieveId;
+			uint32_t lane;
 		} sieveWork;
 	};
 };
 
+// For the optional prefilter, by a batch of primes above the Prime Table Limit. The residues are the ones of the Primorial and of Primorial*SieveSize
+struct PrefilterPrime {
+	uint32_t p, primorialResidue, primorialResidueShoup, segmentResidue; // primorialResidueShoup is floor(primorialResidue*2^32/p), for Shoup's modular multiplication
+};
+
+// A candidate whose first elements were tested, waiting for the test of the next one
+struct FollowUp {
+	uint64_t loop;
+	uint32_t offsetId, index;
+	uint8_t tupleLength;
+};
+
+// A tuple waiting for its BPSW confirmation before being submitted, with the block to submit. A tupleLength of 0 stops the confirmation thread
+struct TupleConfirmation {
+	WorkData block;
+	mpz_class firstElement;
+	uint8_t tupleLength;
+};
+
 struct MinerWorkData {
 	mpz_class verifyTarget, verifyRemainderPrimorial;
+	mpz_class verifyBase; // verifyTarget + verifyRemainderPrimorial, the candidates being verifyBase + Primorial*(loop*SieveSize + index) + offsets
+	std::vector<uint32_t> prefilterResidues; // Of verifyBase
 	WorkData verifyBlock;
 	std::atomic<uint64_t> outstandingTests{0};
+	// The follow ups are staged by tuple element to test, from all the jobs, in order to test them by batches with the Fermat kernel.
+	// The ones beyond the element 1 are tested right away, before the next queued job, and the thread finishing the last queued or running check job flushes the remaining ones.
+	std::mutex followUpsLock;
+	std::vector<std::vector<FollowUp>> followUps;
+	std::atomic<uint64_t> activeChecks{0};
+};
+
+// The sparse primes hits are stored in per bucket linked lists of fixed size blocks taken from a pool, as 24 bits positions in the bucket
+#define SEGMENT_HITS_BLOCK_ENTRIES 336 // The block fits in 1 KiB
+#define SEGMENT_HITS_POOL_CHUNK 64 // Blocks allocated at once when the pool is exhausted, small as each thread has a pool for each Sieve Worker
+struct SegmentHitsBlock {
+	SegmentHitsBlock *next;
+	uint32_t count;
+	// Entry i is in the bytes 3i to 3i + 2, so 4 entries fill 3 aligned 32 bits words. The extra byte allows accessing the last entry with 32 bits loads and stores
+	uint8_t entries[3*SEGMENT_HITS_BLOCK_ENTRIES + 1];
+	
+	uint32_t entry(uint32_t i) const {
+		uint32_t e;
+		memcpy(&e, &entries[3*i], 4);
+		return e & 0xFFFFFF;
+	}
+	void setEntry(uint32_t i, uint32_t e) {memcpy(&entries[3*i], &e, 4);} // Overwrites the first byte of the next entry
+};
+
+// Each thread writes the sparse primes hits of a sieve in its own buckets and pool, so no synchronization is needed
+struct SegmentHitsWriter {
+	SegmentHitsBlock **heads = NULL, **tails = NULL;
+	std::vector<SegmentHitsBlock*> pool;
+	uint64_t poolUsed = 0;
+};
+
+// Part of a sieve worker, sieving its own range of segments in its own thread. The first lane's records get the offsets from the mod work, and the other lanes derive theirs from them.
+struct SieveLane {
+	uint8_t *sieve = NULL;
+	// Dense primes are stored by pairs, in records containing their tuple offsets followed by both primes.
+	// The offsets of the primes below 2^16 always fit in 16 bits, so they have their own records.
+	uint16_t *records16 = NULL;
+	uint32_t *records32 = NULL;
 };
 
 struct SieveInstance {
 	uint32_t id;
 	std::mutex modLock;
-	uint8_t *sieve = NULL;
-	uint32_t **segmentHits = NULL;
-	std::atomic<uint64_t> *segmentCounts = NULL;
-	uint32_t *offsets = NULL;
+	std::mutex hitsWritersLock; // Only for the registration of the writers, which happens during the mod work
+	std::vector<SegmentHitsWriter*> hitsWriters;
+	SieveLane *lanes = NULL;
+	std::mutex lanesReadyLock;
+	std::condition_variable lanesReadyCv;
+	int lanesReady = 0; // Number of lanes that copied the first lane's offsets, which can only be modified after
 };
 
 class Miner {
@@ -98,16 +169,29 @@ class Miner {
 	
 	tsQueue<primeTestWork, 1024> _modWorkQueue;
 	tsQueue<primeTestWork, 4096> _verifyWorkQueue;
+	tsQueue<primeTestWork, 1024> _sieveWorkQueue; // Used instead of the verify queue for the sieve jobs if the threads have roles
+	// The check jobs are pushed to the local queue of the verify thread running the sieve, which takes them first, and the idle threads steal from the others.
+	// The global queue has the mod wake-ups and the sieve jobs, which come first, the check jobs not fitting in the local queues, and the wake-ups of the idle threads.
+	std::vector<std::unique_ptr<mpmcRing<primeTestWork, LOCAL_VERIFY_QUEUE_SIZE>>> _localVerifyQueues;
+	std::atomic<uint32_t> _verifyThreadsRegistered{0}, _idleVerifyThreads{0};
+	std::atomic<bool> _wakeUpPending{false}; // Whether a wake-up of an idle thread for the local check jobs is in the global queue
 	tsQueue<int64_t, 9216> _workDoneQueue;
+	tsQueue<TupleConfirmation, CONFIRMATION_QUEUE_SIZE> _confirmationQueue;
+	std::thread _confirmationThreadHandle;
 	mpz_class _primorial;
-	uint64_t _nPrimes, _entriesPerSegment, _primeTestStoreOffsetsSize, _startingPrimeIndex, _sparseLimit;
+	uint64_t _nPrimes, _primeTestStoreOffsetsSize, _startingPrimeIndex, _offsets16Limit, _sparseLimit;
 	std::vector<uint64_t> _halfPrimeTupleOffset, _primorialOffsetDiff, _primorialOffsetDiffToFirst;
+	std::vector<PrefilterPrime> _prefilterPrimes;
+	std::vector<uint32_t> _prefilterOffsetResidues; // Of the _primorialOffsetDiffToFirst, for each Sieve Worker
+	uint64_t _tupleOffsetsMask; // Bit i is set if i is the offset of an element of the tuple
+	std::vector<uint64_t> _tupleElementOffsets; // Offsets of the tuple elements from the first one
 	SieveInstance* _sieves;
 
 	std::chrono::microseconds _modTime, _sieveTime, _verifyTime;
 	
 	bool _masterExists;
 	std::mutex _masterLock, _tupleFileLock;
+	std::once_flag _fermatFallbackNotice;
 
 	uint64_t _curWorkDataIndex;
 	MinerWorkData _workData[WORK_DATAS];
@@ -153,12 +237,35 @@ class Miner {
 		}
 	}
 	
-	void _putOffsetsInSegments(SieveInstance& sieve, uint64_t *offsets, uint64_t* counts, int n_offsets);
+	void _growSegmentHitsPool(SegmentHitsWriter& writer, uint64_t blocks);
+	SegmentHitsBlock* _appendSegmentHitsBlock(SegmentHitsWriter& writer, uint64_t bucket);
+	void _resetSegmentHitsWriter(SegmentHitsWriter& writer);
+	void _putOffsetsInSegments(SegmentHitsWriter& writer, uint64_t *offsets, uint64_t* counts, int n_offsets);
 	void _updateRemainders(uint32_t workDataIndex, uint64_t start_i, uint64_t end_i);
-	void _processSieve(uint8_t *sieve, uint32_t* offsets, uint64_t start_i, uint64_t end_i);
-	void _processSieve6(uint8_t *sieve, uint32_t* offsets, uint64_t start_i, uint64_t end_i);
-	void _runSieve(SieveInstance& sieve, uint32_t workDataIndex);
-	bool _testPrimesIspc(uint32_t indexes[WORK_INDEXES], uint32_t is_prime[WORK_INDEXES], const mpz_class &ploop, mpz_class &candidate);
+	// Records are padded to a multiple of 16 bytes (a 6-tuples one is 32 bytes with 16 bits offsets or a whole cache line with 32 bits ones)
+	uint64_t _segmentsPerLane() const {return (_parameters.maxIter + _parameters.sieveLanes - 1)/_parameters.sieveLanes;}
+	template <typename T> uint64_t _recordSize() const {return (((2*_parameters.primeTupleOffset.size() + 2)*sizeof(T) + 15) & ~15ull)/sizeof(T);}
+	template <typename T> T* _recordOffsets(T* records, uint64_t i) const {return &records[(i >> 1)*_recordSize<T>() + (i & 1)*_parameters.primeTupleOffset.size()];}
+	template <typename T> T& _recordPrime(T* records, uint64_t i) const {return records[(i >> 1)*_recordSize<T>() + 2*_parameters.primeTupleOffset.size() + (i & 1)];}
+	template <typename T> void _processSieve(uint8_t *sieve, T* records, uint64_t start_i, uint64_t end_i, uint64_t sieveSize);
+	template <typename T> void _processSieve6(uint8_t *sieve, T* records, uint64_t start_i, uint64_t end_i, uint64_t sieveSize);
+	template <typename T> void _shiftRecords(T* records, uint64_t start_i, uint64_t end_i, uint64_t shift);
+	void _initPrefilter();
+	uint32_t _prefilter(uint32_t *candidates, uint32_t n, const std::vector<uint32_t> &loopResidues);
+	void _runSieve(SieveInstance& sieve, uint32_t lane, uint32_t workDataIndex);
+	mp_size_t _candidateLimbs(std::vector<mp_limb_t> &limbs, uint32_t workDataIndex, uint64_t factor, uint64_t offset) const;
+	FermatKernel _fermatKernelFor(uint32_t N_Size);
+	bool _testPrimesIspc(uint32_t workDataIndex, uint64_t loop, uint32_t offsetId, uint32_t indexes[WORK_INDEXES], uint32_t n, uint32_t is_prime[WORK_INDEXES]);
+	void _followUpCandidate(mpz_class &candidate, uint32_t workDataIndex, const FollowUp &followUp, uint32_t element);
+	bool _advanceFollowUp(uint32_t workDataIndex, FollowUp &followUp, uint32_t element, bool isPrime);
+	void _processFollowUps(uint32_t workDataIndex, bool flush);
+	void _confirmationThread();
+	void _initCpuAffinity();
+	void _pushCheckJob(const primeTestWork &job);
+	bool _popCheckJob(primeTestWork &job);
+	uint32_t _queuedVerifyJobs();
+	void _submitTuple(uint32_t workDataIndex, const mpz_class &firstElement, uint8_t tupleLength);
+	void _reportTuple(const mpz_class &firstElement, uint8_t tupleLength);
 	void _verifyThread();
 	void _getTargetFromBlock(mpz_class &target, const WorkData& block);
 	void _processOneBlock(uint32_t workDataIndex, bool isNewHeight);
@@ -171,12 +278,13 @@ class Miner {
 		_currentHeight = 0;
 		_parameters = MinerParameters();
 		_nPrimes = 0;
-		_entriesPerSegment = 0;
 		_primeTestStoreOffsetsSize = 0;
 		_startingPrimeIndex = 0;
+		_offsets16Limit = 0;
 		_sparseLimit = 0;
 		_masterExists = false;
 	}
+	~Miner();
 	
 	void init();
 	void process(WorkData block);
@@ -10,6 +10,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
@@ -80,7 +81,9 @@ static uint32_t setup_fermat(uint32_t N_Size, int num, const mp_limb_t* M, mp_li
 		// REDCify: r = B^n * 2 % M
 		mp = &M[j*N_Size];
 		rp = &R[j*N_Size];
-		mpn_div_qr_invert(&minv, mp, mn);
+		// The numbers of a job usually only differ by their lower limbs, and the normalization and inverse only depend on the three highest ones
+		if (j == 0 || mn < 3 || memcmp(&mp[mn - 3], &M[(j - 1)*N_Size + mn - 3], 3*sizeof(mp_limb_t)) != 0)
+			mpn_div_qr_invert(&minv, mp, mn);
 
 		if (minv.shift > 0)
 		{
@@ -105,13 +108,78 @@ static uint32_t setup_fermat(uint32_t N_Size, int num, const mp_limb_t* M, mp_li
 	return minv.shift;
 }
 
+// R = 2^(limb_bits*n) % M for the IFMA and lazy reduction kernels, with n = ceil((bits + 4)/limb_bits), bits being the largest size of the numbers
+static uint32_t setup_fermat_limbs(uint32_t N_Size, int num, const mp_limb_t* M, mp_limb_t* R, uint32_t limb_bits)
+{
+	uint32_t bits = 0;
+	for (int j = 0; j < num; ++j)
+	{
+		int top = N_Size - 1;
+		while (top > 0 && M[j*N_Size + top] == 0) --top;
+		const uint32_t j_bits = 32*top + 32 - __builtin_clz(M[j*N_Size + top]);
+		if (j_bits > bits) bits = j_bits;
+	}
+	const uint32_t e = limb_bits*((bits + 4 + limb_bits - 1)/limb_bits);
+
+	struct gmp_div_inverse minv;
+	for (int j = 0; j < num; ++j)
+	{
+		mp_size_t mn = N_Size;
+		mp_limb_t mshifted[MAX_N_SIZE_IFMA], r[MAX_N_SIZE_IFMA + 8];
+		mp_srcptr mp = &M[j*N_Size];
+		if (j == 0 || mn < 3 || memcmp(&mp[mn - 3], &M[(j - 1)*N_Size + mn - 3], 3*sizeof(mp_limb_t)) != 0)
+			mpn_div_qr_invert(&minv, mp, mn);
+
+		if (minv.shift > 0)
+		{
+			mpn_lshift(mshifted, mp, mn, minv.shift);
+			mp = mshifted;
+		}
+
+		const mp_size_t rn = (e + minv.shift)/32 + 1;
+		for (int i = 0; i < rn; ++i) r[i] = 0;
+		r[rn - 1] = 1 << ((e + minv.shift) % 32);
+		mpn_div_r_preinv_ns(r, rn, mp, mn, &minv);
+
+		if (minv.shift > 0) mpn_rshift(&R[j*N_Size], r, mn, minv.shift);
+		else memcpy(&R[j*N_Size], r, mn*sizeof(mp_limb_t));
+	}
+	return bits;
+}
+
+bool fermatKernelSupports(FermatKernel kernel, int N_Size)
+{
+	if (kernel == FERMAT_SCALAR) return N_Size >= 1 && N_Size <= MAX_N_SIZE_IFMA;
+	else if (kernel == FERMAT_AVX512IFMA) return N_Size >= 3 && N_Size <= MAX_N_SIZE_IFMA;
+	else if (kernel == FERMAT_AVX2 || kernel == FERMAT_AVX512) return N_Size >= 3 && N_Size <= MAX_N_SIZE;
+	else if (kernel == FERMAT_AVX2_ISPC || kernel == FERMAT_AVX512_ISPC) return N_Size >= 6 && N_Size <= MAX_N_SIZE;
+	else return false;
+}
+
+// Grows a thread local buffer if needed, as the largest numbers would not fit in the stack
+static uint32_t* thread_buffer(uint32_t** buffer, uint32_t* size, uint32_t needed)
+{
+	if (*size < needed)
+	{
+		free(*buffer);
+		*buffer = (uint32_t*) malloc(needed*sizeof(uint32_t));
+		if (*buffer == NULL)
+		{
+			printf("Unable to allocate a Fermat test buffer\n");
+			abort();
+		}
+		*size = needed;
+	}
+	return *buffer;
+}
+
 #if DEBUG
 #define DPRINTF(fmt, args...) do { printf("line %d: " fmt, __LINE__, ##args); fflush(stdout); } while(0)
 #else
 #define DPRINTF(fmt, ...) do { } while(0)
 #endif
 
-void fermatTest(int N_Size, int listSize, uint32_t* M, uint32_t* is_prime, bool use_avx512)
+void fermatTest(int N_Size, int listSize, uint32_t* M, uint32_t* is_prime, FermatKernel kernel)
 {
 	// Because of the way the ISPC code uses the stack, we must ensure
 	// enough stack is paged in before running the test.
@@ -120,26 +188,71 @@ void fermatTest(int N_Size, int listSize, uint32_t* M, uint32_t* is_prime, bool
 		inited = true;
 	}
 
-	if (N_Size < 6 || N_Size > MAX_N_SIZE)
+	if (!fermatKernelSupports(kernel, N_Size))
 	{
 		printf("N Size out of bounds\n");
 		abort();
 	}
 
-	if (listSize % JOB_SIZE)
+	// No lanes to fill for the scalar kernel
+	if (kernel == FERMAT_SCALAR)
 	{
-		printf("Incorrect list size alignment\n");
-		abort();
+		for (int i = 0; i < listSize; ++i)
+			is_prime[i] = fermat_test_scalar(&M[i*N_Size], N_Size);
+		return;
 	}
 
+	static thread_local uint32_t *R_buffer = NULL, *M_tail_buffer = NULL;
+	static thread_local uint32_t R_buffer_size = 0, M_tail_buffer_size = 0;
 	uint32_t MI[MAX_N_SIZE];
-	uint32_t R[MAX_N_SIZE * JOB_SIZE + 5];
+	uint32_t* R = thread_buffer(&R_buffer, &R_buffer_size, N_Size*JOB_SIZE + 5);
+	uint32_t* M_tail = thread_buffer(&M_tail_buffer, &M_tail_buffer_size, N_Size*JOB_SIZE);
+	uint32_t is_prime_tail[JOB_SIZE];
 
 	while (listSize > 0)
 	{
-		uint32_t shift = setup_fermat(N_Size, JOB_SIZE, M, MI, R);
-		if (use_avx512) ispc::fermat_test512(M, MI, R, is_prime, N_Size, shift);
-		else ispc::fermat_test(M, MI, R, is_prime, N_Size, shift);
+		uint32_t* job_M = M;
+		uint32_t* job_is_prime = is_prime;
+		if (listSize < JOB_SIZE)
+		{
+			// Pad the last job with copies of its last number
+			memcpy(M_tail, M, listSize*N_Size*4);
+			for (int i = listSize; i < JOB_SIZE; ++i)
+				memcpy(&M_tail[i*N_Size], &M[(listSize - 1)*N_Size], N_Size*4);
+			job_M = M_tail;
+			job_is_prime = is_prime_tail;
+		}
+
+		if (kernel == FERMAT_AVX512IFMA)
+		{
+			const uint32_t bits = setup_fermat_limbs(N_Size, JOB_SIZE, job_M, R, 52);
+			for (int j = 0; j < JOB_SIZE; j += 8)
+				fermat_test_ifma(&job_M[j*N_Size], &R[j*N_Size], &job_is_prime[j], N_Size, bits);
+		}
+		else if (kernel == FERMAT_AVX512)
+		{
+			const uint32_t bits = setup_fermat_limbs(N_Size, JOB_SIZE, job_M, R, 28);
+			for (int j = 0; j < JOB_SIZE; j += 8)
+				fermat_test_avx512(&job_M[j*N_Size], &R[j*N_Size], &job_is_prime[j], N_Size, bits);
+		}
+		else if (kernel == FERMAT_AVX2)
+		{
+			const uint32_t bits = setup_fermat_limbs(N_Size, JOB_SIZE, job_M, R, 28);
+			for (int j = 0; j < JOB_SIZE; j += 4)
+				fermat_test_avx2(&job_M[j*N_Size], &R[j*N_Size], &job_is_prime[j], N_Size, bits);
+		}
+		else
+		{
+			uint32_t shift = setup_fermat(N_Size, JOB_SIZE, job_M, MI, R);
+			if (kernel == FERMAT_AVX512_ISPC) ispc::fermat_test512(job_M, MI, R, job_is_prime, N_Size, shift);
+			else ispc::fermat_test(job_M, MI, R, job_is_prime, N_Size, shift);
+		}
+
+		if (listSize < JOB_SIZE)
+		{
+			memcpy(is_prime, is_prime_tail, listSize*4);
+			break;
+		}
 		M += JOB_SIZE*N_Size;
 		is_prime += JOB_SIZE;
 		listSize -= JOB_SIZE;
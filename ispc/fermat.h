@@ -1,5 +1,26 @@
+#ifndef HEADER_fermat_h
+#define HEADER_fermat_h
+
 #include <stdint.h>
 
-#define MAX_N_SIZE 64
+#define MAX_N_SIZE 64 // 2048 bits, for the AVX2 and AVX-512 kernels
+#define MAX_N_SIZE_IFMA 1024 // 32768 bits, also for the scalar kernel
+
+// The GMP one is not a kernel of fermatTest, the caller must use mpz_powm or similar instead. The AVX2 and AVX-512 ones use lazy reduction, the ISPC ones are the former kernels.
+enum FermatKernel {FERMAT_GMP, FERMAT_SCALAR, FERMAT_AVX2, FERMAT_AVX512, FERMAT_AVX512IFMA, FERMAT_AVX2_ISPC, FERMAT_AVX512_ISPC};
+
+// Whether the kernel can test numbers of N_Size 32 bits limbs
+bool fermatKernelSupports(FermatKernel kernel, int N_Size);
+
+// Any list size is accepted, the last job of the kernels being padded if needed
+void fermatTest(int N_Size, int listSize, uint32_t* M, uint32_t* is_prime, FermatKernel kernel);
+
+// From fermat_ifma.cpp, tests 8 numbers
+void fermat_test_ifma(const uint32_t* M, const uint32_t* R, uint32_t* is_prime, uint32_t N_Size, uint32_t bits);
+// From fermat_scalar.cpp, tests 1 number
+uint32_t fermat_test_scalar(const uint32_t* M, uint32_t N_Size);
+// From fermat_avx.cpp, test 4 and 8 numbers
+void fermat_test_avx2(const uint32_t* M, const uint32_t* R, uint32_t* is_prime, uint32_t N_Size, uint32_t bits);
+void fermat_test_avx512(const uint32_t* M, const uint32_t* R, uint32_t* is_prime, uint32_t N_Size, uint32_t bits);
 
-void fermatTest(int N_Size, int listSize, uint32_t* M, uint32_t* is_prime, bool use_avx512);
+#endif
@@ -0,0 +1,122 @@
+/* Base 2 Fermat test with AVX2 or AVX-512, using 28 bits limbs and the vpmuludq instruction.
+
+  This is a lazy reduction (almost Montgomery) variant of the ISPC kernels. The lanes of the vectors hold the limbs of 4 or 8 different numbers,
+  and the 56 bits products are accumulated in 64 bits without any carry propagation, which is only done once per row of the reduction.
+  Like for the IFMA kernel, the Montgomery arithmetic uses R = 2^(28*n), with 16*M <= R, so the squaring of any x < 4*M gives a result < 2*M,
+  which can be doubled without any conditional subtraction. The lanes then never diverge, the correction being deferred to the final reduction.
+
+  The arithmetic is specialized for each number of limbs, so the compiler can unroll the loops. */
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fermat.h"
+
+#define LAZY_LIMB_BITS 28
+#define LAZY_MAX_LIMBS ((MAX_N_SIZE*32 + 4 + LAZY_LIMB_BITS - 1)/LAZY_LIMB_BITS)
+
+static const uint64_t mask28 = (1ULL << LAZY_LIMB_BITS) - 1;
+
+// The instructions used by the kernel, for 4 (AVX2) or 8 (AVX-512) lanes. The masks have a bit by lane.
+struct Avx2
+{
+	typedef __m256i V;
+	enum {lanes = 4};
+	__attribute__((target("avx2"))) static inline V mul(V a, V b) {return _mm256_mul_epu32(a, b);}
+	__attribute__((target("avx2"))) static inline V add(V a, V b) {return _mm256_add_epi64(a, b);}
+	__attribute__((target("avx2"))) static inline V high(V a) {return _mm256_srli_epi64(a, LAZY_LIMB_BITS);}
+	__attribute__((target("avx2"))) static inline V low(V a) {return _mm256_and_si256(a, _mm256_set1_epi64x(mask28));}
+	__attribute__((target("avx2"))) static inline V zero() {return _mm256_setzero_si256();}
+	__attribute__((target("avx2"))) static inline V set1(uint64_t a) {return _mm256_set1_epi64x(a);}
+	__attribute__((target("avx2"))) static inline uint32_t equal(V a, V b) {return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(a, b)));}
+	__attribute__((target("avx2"))) static inline uint32_t test(V a, V b) {return equal(_mm256_and_si256(a, b), b);}
+	__attribute__((target("avx2"))) static inline V select(uint32_t mask, V a, V b)
+	{
+		const V bits = _mm256_setr_epi64x(1, 2, 4, 8);
+		return _mm256_blendv_epi8(b, a, _mm256_cmpeq_epi64(_mm256_and_si256(_mm256_set1_epi64x(mask), bits), bits));
+	}
+};
+
+struct Avx512
+{
+	typedef __m512i V;
+	enum {lanes = 8};
+	// The maskz versions avoid a false uninitialized warning of GCC
+	__attribute__((target("avx512f"))) static inline V mul(V a, V b) {return _mm512_maskz_mul_epu32(0xFF, a, b);}
+	__attribute__((target("avx512f"))) static inline V add(V a, V b) {return _mm512_add_epi64(a, b);}
+	__attribute__((target("avx512f"))) static inline V high(V a) {return _mm512_maskz_srli_epi64(0xFF, a, LAZY_LIMB_BITS);}
+	__attribute__((target("avx512f"))) static inline V low(V a) {return _mm512_and_si512(a, _mm512_set1_epi64(mask28));}
+	__attribute__((target("avx512f"))) static inline V zero() {return _mm512_setzero_si512();}
+	__attribute__((target("avx512f"))) static inline V set1(uint64_t a) {return _mm512_set1_epi64(a);}
+	__attribute__((target("avx512f"))) static inline uint32_t equal(V a, V b) {return _mm512_cmpeq_epi64_mask(a, b);}
+	__attribute__((target("avx512f"))) static inline uint32_t test(V a, V b) {return _mm512_test_epi64_mask(a, b);}
+	__attribute__((target("avx512f"))) static inline V select(uint32_t mask, V a, V b) {return _mm512_mask_mov_epi64(b, mask, a);}
+};
+
+// Gives the n 28 bits limbs of the N_Size 32 bits limbs numbers of the lanes
+template <class A>
+static void to_limbs28(typename A::V* x, const uint32_t* X, uint32_t N_Size, uint32_t n)
+{
+	uint8_t bytes[MAX_N_SIZE*4 + 16];
+	for (int j = 0; j < A::lanes; ++j)
+	{
+		memset(bytes, 0, sizeof(bytes));
+		memcpy(bytes, &X[j*N_Size], N_Size*4);
+		for (uint32_t k = 0; k < n; ++k)
+		{
+			uint64_t v;
+			memcpy(&v, &bytes[(k*LAZY_LIMB_BITS)/8], 8);
+			v = (v >> ((k*LAZY_LIMB_BITS) % 8)) & mask28;
+			memcpy((uint64_t*) &x[k] + j, &v, 8);
+		}
+	}
+}
+
+#define LAZY_TARGET __attribute__((target("avx2")))
+namespace lazy_avx2
+{
+#include "fermat_avx_kernel.h"
+}
+#undef LAZY_TARGET
+
+#define LAZY_TARGET __attribute__((target("avx512f")))
+namespace lazy_avx512
+{
+#include "fermat_avx_kernel.h"
+}
+#undef LAZY_TARGET
+
+// Tests A::lanes numbers M of N_Size 32 bits limbs and at most bits bits, R being 2^(28*n) mod M with n = ceil((bits + 4)/28)
+template <class A, class F>
+static void fermat_test_lazy(const F* table, const uint32_t* M, const uint32_t* R, uint32_t* is_prime, uint32_t N_Size, uint32_t bits)
+{
+	const uint32_t n = (bits + 4 + LAZY_LIMB_BITS - 1)/LAZY_LIMB_BITS;
+	typename A::V m[LAZY_MAX_LIMBS], x[LAZY_MAX_LIMBS];
+	to_limbs28<A>(m, M, N_Size, n);
+	to_limbs28<A>(x, R, N_Size, n); // Montgomery form of 1
+
+	// -1/M mod 2^28, by Newton's iteration (M is its own inverse mod 2^3)
+	alignas(64) uint64_t m_inv_lanes[A::lanes];
+	for (int j = 0; j < A::lanes; ++j)
+	{
+		uint32_t inv = M[j*N_Size];
+		for (int i = 0; i < 4; ++i) inv *= 2 - M[j*N_Size]*inv;
+		m_inv_lanes[j] = (-inv) & mask28;
+	}
+	typename A::V m_inv;
+	memcpy(&m_inv, m_inv_lanes, sizeof(m_inv));
+
+	const uint32_t one = table[n](x, m, &m_inv, bits);
+	for (int j = 0; j < A::lanes; ++j) is_prime[j] = (one >> j) & 1;
+}
+
+void fermat_test_avx2(const uint32_t* M, const uint32_t* R, uint32_t* is_prime, uint32_t N_Size, uint32_t bits)
+{
+	fermat_test_lazy<Avx2>(lazy_avx2::fermat_lazy_table<Avx2>(), M, R, is_prime, N_Size, bits);
+}
+
+void fermat_test_avx512(const uint32_t* M, const uint32_t* R, uint32_t* is_prime, uint32_t N_Size, uint32_t bits)
+{
+	fermat_test_lazy<Avx512>(lazy_avx512::fermat_lazy_table<Avx512>(), M, R, is_prime, N_Size, bits);
+}
@@ -0,0 +1,116 @@
+/* Arithmetic of the lazy reduction Fermat kernels, included by fermat_avx.cpp once per instruction set, in its own namespace.
+  LAZY_TARGET gives the target of the functions, so the AVX-512 ones are compiled for AVX-512 even if the rest of the program is not,
+  and the AVX2 ones cannot use AVX-512. No vector is passed by value to a function of another target. */
+
+// r = t/R mod M, r < 2*M if t < 4*M^2. t has 2n + 1 limbs, which may exceed 28 bits, and is destroyed.
+// The limbs of t accumulate at most 2n + 1 products of 56 bits, which is fine for n < 128
+template <class A, uint32_t n>
+LAZY_TARGET
+static inline void redc28(typename A::V* r, typename A::V* t, const typename A::V* m, typename A::V m_inv)
+{
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		const typename A::V q = A::low(A::mul(t[i], m_inv));
+		for (uint32_t j = 0; j < n; ++j)
+			t[i + j] = A::add(t[i + j], A::mul(q, m[j]));
+		t[i + 1] = A::add(t[i + 1], A::high(t[i]));
+	}
+
+	for (uint32_t k = 0; k < n; ++k)
+	{
+		r[k] = A::low(t[n + k]);
+		t[n + k + 1] = A::add(t[n + k + 1], A::high(t[n + k]));
+	}
+}
+
+// x = x^2/R mod M, using the 2n + 1 limbs of t as scratch
+template <class A, uint32_t n>
+LAZY_TARGET
+static inline void square28(typename A::V* x, const typename A::V* m, typename A::V m_inv, typename A::V* t)
+{
+	for (uint32_t k = 0; k <= 2*n; ++k) t[k] = A::zero();
+
+	// Products of different limbs are computed once and doubled
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		for (uint32_t j = i + 1; j < n; ++j)
+			t[i + j] = A::add(t[i + j], A::mul(x[i], x[j]));
+	}
+	for (uint32_t k = 0; k < 2*n; ++k) t[k] = A::add(t[k], t[k]);
+	for (uint32_t i = 0; i < n; ++i)
+		t[2*i] = A::add(t[2*i], A::mul(x[i], x[i]));
+
+	redc28<A, n>(x, t, m, m_inv);
+}
+
+// x = 2*x in the lanes of the mask
+template <class A, uint32_t n>
+LAZY_TARGET
+static inline void double28(typename A::V* x, uint32_t lanes)
+{
+	typename A::V carry = A::zero();
+	for (uint32_t k = 0; k < n; ++k)
+	{
+		const typename A::V v = A::add(A::add(x[k], x[k]), carry);
+		carry = A::high(v);
+		x[k] = A::select(lanes, A::low(v), x[k]);
+	}
+}
+
+// x = 2^(M - 1) mod M, from the highest bit, with x being the Montgomery form of 1 and M having at most bits bits. M - 1 and M only differ by the bit 0, which is 0 for M - 1.
+// Out of the Montgomery form, the result is at most M, so it is 1 if and only if 2^(M - 1) = 1 mod M
+template <class A, uint32_t n>
+LAZY_TARGET
+static uint32_t fermat_lazy(typename A::V* x, const typename A::V* m, const typename A::V* m_inv_ptr, uint32_t bits)
+{
+	const typename A::V m_inv = *m_inv_ptr;
+	typename A::V y[n], t[2*n + 1];
+	for (uint32_t k = 0; k < n; ++k) y[k] = x[k];
+	for (int b = bits - 1; b >= 0; --b)
+	{
+		square28<A, n>(y, m, m_inv, t);
+		if (b > 0)
+		{
+			const uint32_t lanes = A::test(m[b/LAZY_LIMB_BITS], A::set1(1ULL << (b % LAZY_LIMB_BITS)));
+			if (lanes) double28<A, n>(y, lanes);
+		}
+	}
+
+	for (uint32_t k = 0; k <= 2*n; ++k) t[k] = k < n ? y[k] : A::zero();
+	redc28<A, n>(y, t, m, m_inv);
+	uint32_t one = A::equal(y[0], A::set1(1));
+	for (uint32_t k = 1; k < n; ++k) one &= A::equal(y[k], A::zero());
+	return one;
+}
+
+// Table of the specializations, by number of limbs
+template <class A> struct FermatLazyFunction
+{
+	typedef uint32_t (*Type)(typename A::V*, const typename A::V*, const typename A::V*, uint32_t);
+};
+template <class A, uint32_t n> struct FermatLazyTable
+{
+	static void fill(typename FermatLazyFunction<A>::Type* table)
+	{
+		table[n] = &fermat_lazy<A, n>;
+		FermatLazyTable<A, n - 1>::fill(table);
+	}
+};
+template <class A> struct FermatLazyTable<A, 0>
+{
+	static void fill(typename FermatLazyFunction<A>::Type* table) {table[0] = NULL;}
+};
+
+template <class A> struct FermatLazyFunctions
+{
+	typename FermatLazyFunction<A>::Type table[LAZY_MAX_LIMBS + 1];
+	FermatLazyFunctions() {FermatLazyTable<A, LAZY_MAX_LIMBS>::fill(table);}
+};
+
+// The verify threads can call the kernel at the same time, the initialization of the local static is thread safe
+template <class A>
+static const typename FermatLazyFunction<A>::Type* fermat_lazy_table()
+{
+	static const FermatLazyFunctions<A> functions;
+	return functions.table;
+}
@@ -0,0 +1,208 @@
+/* Base 2 Fermat test with AVX-512 IFMA, using 52 bits limbs and the vpmadd52luq/vpmadd52huq instructions.
+
+  The 8 lanes of the vectors hold the limbs of 8 different numbers. The Montgomery arithmetic uses R = 2^(52*n), with 16*M <= R,
+  so the squaring of any x < 4*M gives a result < 2*M, which can be doubled without any conditional subtraction.
+
+  The arithmetic is specialized for each number of limbs up to the size of the ISPC kernels, so the compiler can unroll the loops and keep small numbers
+  in registers. Larger numbers use a generic version (N = 0) with heap scratch. */
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fermat.h"
+
+#define IFMA_LANES 8
+#define IFMA_LIMB_BITS 52
+#define IFMA_LIMBS(N_Size) (((N_Size)*32 + 4 + IFMA_LIMB_BITS - 1)/IFMA_LIMB_BITS)
+#define IFMA_SPECIALIZED_LIMBS IFMA_LIMBS(MAX_N_SIZE)
+
+static const uint64_t mask52 = (1ULL << IFMA_LIMB_BITS) - 1;
+
+// Bits above the 52 lowest, like _mm512_srli_epi64 but avoiding a false uninitialized warning of GCC
+__attribute__((target("avx512f")))
+static inline __m512i high52(__m512i v)
+{
+	return _mm512_maskz_srli_epi64(0xFF, v, IFMA_LIMB_BITS);
+}
+
+// Gives the n 52 bits limbs of the N_Size 32 bits limbs numbers of the 8 lanes
+static void to_limbs52(__m512i* x, const uint32_t* X, uint32_t N_Size, uint32_t n)
+{
+	uint8_t bytes[MAX_N_SIZE_IFMA*4 + 16];
+	for (int j = 0; j < IFMA_LANES; ++j)
+	{
+		memset(bytes, 0, sizeof(bytes));
+		memcpy(bytes, &X[j*N_Size], N_Size*4);
+		for (uint32_t k = 0; k < n; ++k)
+		{
+			uint64_t v;
+			memcpy(&v, &bytes[(k*IFMA_LIMB_BITS)/8], 8);
+			v = (v >> ((k*IFMA_LIMB_BITS) % 8)) & mask52;
+			memcpy((uint64_t*) &x[k] + j, &v, 8);
+		}
+	}
+}
+
+// r = t/R mod M, r < 2*M if t < 4*M^2. t has 2n + 1 limbs, which may exceed 52 bits, and is destroyed
+template <uint32_t N>
+__attribute__((target("avx512f,avx512ifma")))
+static inline void redc52(__m512i* r, __m512i* t, const __m512i* m, __m512i m_inv, uint32_t n_generic)
+{
+	const uint32_t n = N > 0 ? N : n_generic;
+	const __m512i zero = _mm512_setzero_si512(), mask = _mm512_set1_epi64(mask52);
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		const __m512i q = _mm512_madd52lo_epu64(zero, t[i], m_inv);
+		for (uint32_t j = 0; j < n; ++j)
+		{
+			t[i + j] = _mm512_madd52lo_epu64(t[i + j], q, m[j]);
+			t[i + j + 1] = _mm512_madd52hi_epu64(t[i + j + 1], q, m[j]);
+		}
+		t[i + 1] = _mm512_add_epi64(t[i + 1], high52(t[i]));
+	}
+
+	for (uint32_t k = 0; k < n; ++k)
+	{
+		r[k] = _mm512_and_si512(t[n + k], mask);
+		t[n + k + 1] = _mm512_add_epi64(t[n + k + 1], high52(t[n + k]));
+	}
+}
+
+// x = x^2/R mod M, using 2n + 1 limbs of scratch
+template <uint32_t N>
+__attribute__((target("avx512f,avx512ifma")))
+static inline void square52(__m512i* x, const __m512i* m, __m512i m_inv, __m512i* t, uint32_t n_generic)
+{
+	const uint32_t n = N > 0 ? N : n_generic;
+	for (uint32_t k = 0; k <= 2*n; ++k) t[k] = _mm512_setzero_si512();
+
+	// Products of different limbs are computed once and doubled
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		for (uint32_t j = i + 1; j < n; ++j)
+		{
+			t[i + j] = _mm512_madd52lo_epu64(t[i + j], x[i], x[j]);
+			t[i + j + 1] = _mm512_madd52hi_epu64(t[i + j + 1], x[i], x[j]);
+		}
+	}
+	for (uint32_t k = 0; k < 2*n; ++k) t[k] = _mm512_add_epi64(t[k], t[k]);
+	for (uint32_t i = 0; i < n; ++i)
+	{
+		t[2*i] = _mm512_madd52lo_epu64(t[2*i], x[i], x[i]);
+		t[2*i + 1] = _mm512_madd52hi_epu64(t[2*i + 1], x[i], x[i]);
+	}
+
+	redc52<N>(x, t, m, m_inv, n);
+}
+
+// x = 2*x in the lanes of the mask
+template <uint32_t N>
+__attribute__((target("avx512f")))
+static inline void double52(__m512i* x, __mmask8 lanes, uint32_t n_generic)
+{
+	const uint32_t n = N > 0 ? N : n_generic;
+	const __m512i mask = _mm512_set1_epi64(mask52);
+	__m512i carry = _mm512_setzero_si512();
+	for (uint32_t k = 0; k < n; ++k)
+	{
+		const __m512i v = _mm512_add_epi64(_mm512_add_epi64(x[k], x[k]), carry);
+		carry = high52(v);
+		x[k] = _mm512_mask_and_epi64(x[k], lanes, v, mask);
+	}
+}
+
+// x = 2^(M - 1) mod M, from the highest bit, with x being the Montgomery form of 1 and M having at most bits bits. M - 1 and M only differ by the bit 0, which is 0 for M - 1.
+// Out of the Montgomery form, the result is at most M, so it is 1 if and only if 2^(M - 1) = 1 mod M
+// The generic version uses the 3n + 1 limbs of scratch, the specialized ones their own stack arrays
+template <uint32_t N>
+__attribute__((target("avx512f,avx512ifma")))
+static __mmask8 fermat_ifma(__m512i* x, const __m512i* m, __m512i m_inv, uint32_t bits, uint32_t n_generic, __m512i* scratch)
+{
+	const uint32_t n = N > 0 ? N : n_generic;
+	__m512i y_specialized[N > 0 ? N : 1], t_specialized[2*N + 1];
+	__m512i *y = N > 0 ? y_specialized : scratch, *t = N > 0 ? t_specialized : &scratch[n];
+	for (uint32_t k = 0; k < n; ++k) y[k] = x[k];
+	for (int b = bits - 1; b >= 0; --b)
+	{
+		square52<N>(y, m, m_inv, t, n);
+		if (b > 0)
+		{
+			const __mmask8 lanes = _mm512_test_epi64_mask(m[b/IFMA_LIMB_BITS], _mm512_set1_epi64(1ULL << (b % IFMA_LIMB_BITS)));
+			if (lanes) double52<N>(y, lanes, n);
+		}
+	}
+
+	for (uint32_t k = 0; k <= 2*n; ++k) t[k] = k < n ? y[k] : _mm512_setzero_si512();
+	redc52<N>(y, t, m, m_inv, n);
+	__mmask8 one = _mm512_cmpeq_epi64_mask(y[0], _mm512_set1_epi64(1));
+	for (uint32_t k = 1; k < n; ++k) one &= _mm512_cmpeq_epi64_mask(y[k], _mm512_setzero_si512());
+	return one;
+}
+
+// Table of the specializations, by number of limbs
+typedef __mmask8 (*FermatIfmaFunction)(__m512i*, const __m512i*, __m512i, uint32_t, uint32_t, __m512i*);
+template <uint32_t n> struct FermatIfmaTable
+{
+	static void fill(FermatIfmaFunction* table)
+	{
+		table[n] = &fermat_ifma<n>;
+		FermatIfmaTable<n - 1>::fill(table);
+	}
+};
+template <> struct FermatIfmaTable<0>
+{
+	static void fill(FermatIfmaFunction* table) {table[0] = &fermat_ifma<0>;}
+};
+
+struct FermatIfmaFunctions
+{
+	FermatIfmaFunction table[IFMA_SPECIALIZED_LIMBS + 1];
+	FermatIfmaFunctions() {FermatIfmaTable<IFMA_SPECIALIZED_LIMBS>::fill(table);}
+};
+
+// The verify threads can call the kernel at the same time, the initialization of the local static is thread safe
+static const FermatIfmaFunction* fermat_ifma_table()
+{
+	static const FermatIfmaFunctions functions;
+	return functions.table;
+}
+
+// Tests 8 numbers M of N_Size 32 bits limbs and at most bits bits, R being 2^(52*n) mod M with n = ceil((bits + 4)/52)
+__attribute__((target("avx512f,avx512ifma")))
+void fermat_test_ifma(const uint32_t* M, const uint32_t* R, uint32_t* is_prime, uint32_t N_Size, uint32_t bits)
+{
+	const uint32_t n = (bits + 4 + IFMA_LIMB_BITS - 1)/IFMA_LIMB_BITS;
+	// m, x, and for the generic version, 3n + 1 limbs of scratch
+	static thread_local __m512i* buffer = NULL;
+	static thread_local uint32_t buffer_limbs = 0;
+	if (buffer_limbs < 5*n + 1)
+	{
+		_mm_free(buffer);
+		buffer_limbs = 5*n + 1;
+		buffer = (__m512i*) _mm_malloc(buffer_limbs*sizeof(__m512i), 64);
+		if (buffer == NULL)
+		{
+			printf("Unable to allocate the IFMA Fermat kernel buffer\n");
+			abort();
+		}
+	}
+	__m512i *m = buffer, *x = &buffer[n];
+	to_limbs52(m, M, N_Size, n);
+	to_limbs52(x, R, N_Size, n); // Montgomery form of 1
+
+	// -1/M mod 2^52, by Newton's iteration (M is its own inverse mod 2^3)
+	alignas(64) uint64_t m_inv_lanes[IFMA_LANES];
+	for (int j = 0; j < IFMA_LANES; ++j)
+	{
+		const uint64_t m0 = M[j*N_Size] | ((uint64_t) M[j*N_Size + 1] << 32);
+		uint64_t inv = m0;
+		for (int i = 0; i < 5; ++i) inv *= 2 - m0*inv;
+		m_inv_lanes[j] = (-inv) & mask52;
+	}
+
+	const __mmask8 one = fermat_ifma_table()[n <= IFMA_SPECIALIZED_LIMBS ? n : 0](x, m, _mm512_load_si512(m_inv_lanes), bits, n, &buffer[2*n]);
+	for (int j = 0; j < IFMA_LANES; ++j) is_prime[j] = (one >> j) & 1;
+}
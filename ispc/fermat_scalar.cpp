@@ -0,0 +1,68 @@
+/* Base 2 Fermat test with 64 bits limbs, for the processors without the SIMD instructions of the other kernels.
+
+  Compared to mpz_powm, the base being 2, the multiplications by the base are just shifts and only the squarings and Montgomery reductions remain,
+  without the allocations and the windowing. They are done with the mpn functions of GMP, which use its assembly (with mulx/adx if supported).
+  mpn_redc_1 is not documented, but exported by GMP since the 5.0 version. */
+
+#include <gmp.h>
+#include <string.h>
+
+#include "fermat.h"
+
+#if GMP_LIMB_BITS != 64
+#error "The scalar Fermat kernel needs 64 bits limbs"
+#endif
+
+#define SCALAR_MAX_LIMBS (MAX_N_SIZE_IFMA/2)
+
+extern "C" mp_limb_t __gmpn_redc_1(mp_ptr, mp_ptr, mp_srcptr, mp_size_t, mp_limb_t);
+
+// Tests a number M of N_Size 32 bits limbs. The values are kept below B^n instead of M, like mpz_powm does.
+uint32_t fermat_test_scalar(const uint32_t* M, uint32_t N_Size)
+{
+	int top = N_Size - 1;
+	while (top > 0 && M[top] == 0) --top;
+	const uint32_t bits = 32*top + 32 - __builtin_clz(M[top]);
+	const mp_size_t n = (bits + 63)/64;
+	mp_limb_t m[SCALAR_MAX_LIMBS], x[SCALAR_MAX_LIMBS], t[2*SCALAR_MAX_LIMBS], q[SCALAR_MAX_LIMBS + 1];
+	m[n - 1] = 0;
+	memcpy(m, M, (top + 1)*4);
+
+	// x = B^n mod M, the Montgomery form of 1
+	for (mp_size_t i = 0; i < n; ++i) t[i] = 0;
+	t[n] = 1;
+	mpn_tdiv_qr(q, x, 0, t, n + 1, m, n);
+
+	// -1/M mod B, by Newton's iteration (M is its own inverse mod 2^3)
+	mp_limb_t m_inv = m[0];
+	for (int i = 0; i < 5; ++i) m_inv *= 2 - m[0]*m_inv;
+	m_inv = -m_inv;
+
+	// x = 2^(M - 1) mod M, from the highest bit. M - 1 and M only differ by the bit 0, which is 0 for M - 1.
+	for (int b = bits - 1; b >= 0; --b)
+	{
+		mpn_sqr(t, x, n);
+		if (__gmpn_redc_1(x, t, m, n, m_inv) != 0)
+			mpn_sub_n(x, x, m, n);
+		if (b > 0 && ((m[b/64] >> (b % 64)) & 1))
+		{
+			mp_limb_t carry = mpn_lshift(x, x, n, 1);
+			while (carry != 0)
+				carry -= mpn_sub_n(x, x, m, n);
+		}
+	}
+
+	// Out of the Montgomery form, the result is at most M, so it is 1 if and only if 2^(M - 1) = 1 mod M
+	for (mp_size_t i = 0; i < n; ++i)
+	{
+		t[i] = x[i];
+		t[n + i] = 0;
+	}
+	__gmpn_redc_1(x, t, m, n, m_inv);
+	if (x[0] != 1) return 0;
+	for (mp_size_t i = 1; i < n; ++i)
+	{
+		if (x[i] != 0) return 0;
+	}
+	return 1;
+}
@@ -186,7 +186,22 @@ void Options::loadConf() {
 				else if (key == "Username") _username = value;
 				else if (key == "Password") _password = value;
 				else if (key == "PayoutAddress") setPayoutAddress(value);
-				else if (key == "EnableAVX2") _enableAvx2 = (value == "Yes");
+				else if (key == "FermatKernel") _fermatKernel = value;
+				else if (key == "EnableAVX2") { // Deprecated
+					if (value != "Yes") _fermatKernel = "GMP";
+				}
+				else if (key == "FusedSieve") _fusedSieve = (value == "Yes");
+				else if (key == "ConfirmTuples") _confirmTuples = (value == "Yes");
+				else if (key == "CpuAffinity") _cpuAffinity = (value == "Yes");
+				else if (key == "SieveCpus" || key == "FermatCpus") {
+					for (std::string::size_type i(0) ; i < value.size() ; i++) {if (value[i] == ',') value[i] = ' ';}
+					std::stringstream cpusSS(value);
+					std::vector<uint64_t> cpus;
+					uint64_t tmp;
+					while (cpusSS >> tmp) cpus.push_back(tmp);
+					if (key == "SieveCpus") _sieveCpus = cpus;
+					else _fermatCpus = cpus;
+				}
 				else if (key == "Secret!!!") _secret = value;
 				else if (key == "Threads") {
 					try {_threads = std::stoi(value);}
@@ -196,6 +211,11 @@ void Options::loadConf() {
 					try {_sieveWorkers = std::stoi(value);}
 					catch (...) {_sieveWorkers = 0;}
 				}
+				else if (key == "SieveWorkerThreads") {
+					try {_sieveWorkerThreads = std::stoi(value);}
+					catch (...) {_sieveWorkerThreads = 1;}
+					if (_sieveWorkerThreads < 1) _sieveWorkerThreads = 1;
+				}
 				else if (key == "PrimeTableLimit") {
 					try {_primeTableLimit = std::stoll(value);}
 					catch (...) {_primeTableLimit = 2147483648;}
@@ -205,6 +225,16 @@ void Options::loadConf() {
 					try {_sieveBits = std::stoi(value);}
 					catch (...) {_sieveBits = 25;}
 				}
+				else if (key == "PrefilterPrimes") {
+					try {_prefilterPrimes = std::stoll(value);}
+					catch (...) {_prefilterPrimes = 0;}
+				}
+				else if (key == "SieveSliceBits") {
+					try {_sieveSliceBits = std::stoi(value);}
+					catch (...) {_sieveSliceBits = 21;}
+					if (_sieveSliceBits < 12) _sieveSliceBits = 12;
+					else if (_sieveSliceBits > 24) _sieveSliceBits = 24;
+				}
 				else if (key == "RefreshInterval") {
 					try {_refreshInterval = std::stoi(value);}
 					catch (...) {_refreshInterval = 10;}
@@ -236,7 +266,7 @@ void Options::loadConf() {
 				else if (key == "TuplesFile")
 					_tuplesFile = value;
 				else if (key == "ConstellationType") {
-					for (uint16_t i(0) ; i < value.size() ; i++) {if (value[i] == ',') value[i] = ' ';}
+					for (std::string::size_type i(0) ; i < value.size() ; i++) {if (value[i] == ',') value[i] = ' ';}
 					std::stringstream offsetsSS(value);
 					std::vector<uint64_t> offsets;
 					uint64_t tmp;
@@ -250,7 +280,7 @@ void Options::loadConf() {
 					catch (...) {_primorialNumber = 40;}
 				}
 				else if (key == "PrimorialOffsets") {
-					for (uint16_t i(0) ; i < value.size() ; i++) {if (value[i] == ',') value[i] = ' ';}
+					for (std::string::size_type i(0) ; i < value.size() ; i++) {if (value[i] == ',') value[i] = ' ';}
 					std::stringstream offsets(value);
 					std::vector<uint64_t> primorialOffsets;
 					uint64_t tmp;
@@ -263,7 +293,7 @@ void Options::loadConf() {
 					}
 				}
 				else if (key == "Rules") {
-					for (uint16_t i(0) ; i < value.size() ; i++) {if (value[i] == ',') value[i] = ' ';}
+					for (std::string::size_type i(0) ; i < value.size() ; i++) {if (value[i] == ',') value[i] = ' ';}
 					std::stringstream offsets(value);
 					_rules = std::vector<std::string>();
 					std::string tmp;
@@ -59,13 +59,13 @@ static const std::vector<std::pair<std::vector<uint64_t>, std::vector<uint64_t>>
 };
 
 class Options {
-	bool _enableAvx2, _customPrimorialOffsets;
-	std::string _host, _username, _password, _mode, _payoutAddress, _secret, _tuplesFile;
+	bool _fusedSieve, _confirmTuples, _cpuAffinity, _customPrimorialOffsets;
+	std::string _host, _fermatKernel, _username, _password, _mode, _payoutAddress, _secret, _tuplesFile;
 	AddressFormat _payoutAddressFormat;
-	uint16_t _debug, _port, _threads, _sieveWorkers, _sieveBits, _refreshInterval, _tupleLengthMin, _donate;
+	uint16_t _debug, _port, _threads, _sieveWorkers, _sieveWorkerThreads, _sieveBits, _sieveSliceBits, _refreshInterval, _tupleLengthMin, _donate;
 	uint32_t _benchmarkDifficulty, _benchmarkTimeLimit, _benchmark2tupleCountLimit;
-	uint64_t _primeTableLimit, _primorialNumber;
-	std::vector<uint64_t> _constellationType, _primorialOffsets;
+	uint64_t _primeTableLimit, _primorialNumber, _prefilterPrimes;
+	std::vector<uint64_t> _constellationType, _primorialOffsets, _sieveCpus, _fermatCpus;
 	std::vector<std::string> _rules;
 	
 	void _parseLine(std::string, std::string&, std::string&) const;
@@ -73,9 +73,12 @@ class Options {
 	
 	public:
 	Options() : // Default options: Standard Benchmark with 8 threads
-		_enableAvx2(false),
+		_fusedSieve(false),
+		_confirmTuples(false),
+		_cpuAffinity(false),
 		_customPrimorialOffsets(false),
 		_host("127.0.0.1"),
+		_fermatKernel("Auto"),
 		_username(""),
 		_password(""),
 		_mode("Benchmark"),
@@ -87,7 +90,9 @@ class Options {
 		_port(28332),
 		_threads(8),
 		_sieveWorkers(0),
+		_sieveWorkerThreads(1),
 		_sieveBits(25),
+		_sieveSliceBits(21),
 		_refreshInterval(30),
 		_tupleLengthMin(6),
 		_donate(2),
@@ -96,14 +101,22 @@ class Options {
 		_benchmark2tupleCountLimit(50000),
 		_primeTableLimit(2147483648),
 		_primorialNumber(40),
+		_prefilterPrimes(0),
 		_constellationType(defaultConstellationData[0].first), // What type of constellations are we mining (offsets)
 		_primorialOffsets(defaultConstellationData[0].second),
+		_sieveCpus{},
+		_fermatCpus{},
 		_rules{"segwit"} {}
 	
 	void askConf();
 	void loadConf();
 	
-	bool enableAvx2() const {return _enableAvx2;}
+	std::string fermatKernel() const {return _fermatKernel;}
+	bool fusedSieve() const {return _fusedSieve;}
+	bool confirmTuples() const {return _confirmTuples;}
+	bool cpuAffinity() const {return _cpuAffinity;}
+	std::vector<uint64_t> sieveCpus() const {return _sieveCpus;}
+	std::vector<uint64_t> fermatCpus() const {return _fermatCpus;}
 	std::string mode() const {return _mode;}
 	std::string host() const {return _host;}
 	uint16_t port() const {return _port;}
@@ -116,8 +129,10 @@ class Options {
 	std::string tuplesFile() const {return _tuplesFile;}
 	uint16_t threads() const {return _threads;}
 	uint16_t sieveWorkers() const {return _sieveWorkers;}
+	uint16_t sieveWorkerThreads() const {return _sieveWorkerThreads;}
 	uint64_t primeTableLimit() const {return _primeTableLimit;}
 	uint16_t sieveBits() const {return _sieveBits;}
+	uint16_t sieveSliceBits() const {return _sieveSliceBits;}
 	uint32_t refreshInterval() const {return _refreshInterval;}
 	uint16_t tupleLengthMin() const {return _tupleLengthMin;}
 	uint16_t donate() const {return _donate;}
@@ -126,6 +141,7 @@ class Options {
 	uint32_t benchmark2tupleCountLimit() const {return _benchmark2tupleCountLimit;}
 	std::vector<uint64_t> constellationType() const {return _constellationType;}
 	uint64_t primorialNumber() const {return _primorialNumber;}
+	uint64_t prefilterPrimes() const {return _prefilterPrimes;}
 	std::vector<uint64_t> primorialOffsets() const {return _primorialOffsets;}
 	std::vector<std::string> rules() const {return _rules;}
 };
@@ -229,17 +229,20 @@ std::array<uint8_t, 32> calculateMerkleRootStratum(const std::vector<std::array<
 	return merkleRoot;
 }
 
-CpuID::CpuID() {
+CpuID::CpuID() : _avx(false), _avx2(false), _avx512(false), _avx512ifma(false) {
 	uint32_t eax(0), ebx(0), ecx(0), edx(0);
 	__get_cpuid(0, &eax, &ebx, &ecx, &edx);
-	if (eax < 7) {
-		_avx = false;
-		_avx2 = false;
-		_avx512 = false;
-	}
-	else {
+	if (eax >= 7) {
 		__get_cpuid(1, &eax, &ebx, &ecx, &edx);
-		_avx = (ecx & (1 << 28)) != 0;
+		// The OS must have enabled the saving of the XMM and YMM (XCR0 bits 1 and 2), and for AVX-512, opmask and ZMM (bits 5 to 7) registers
+		bool osAvx(false), osAvx512(false);
+		if ((ecx & (1 << 27)) != 0) { // OSXSAVE
+			uint32_t xcr0Low, xcr0High;
+			asm ("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+			osAvx = (xcr0Low & 0x06) == 0x06;
+			osAvx512 = (xcr0Low & 0xE6) == 0xE6;
+		}
+		_avx = osAvx && (ecx & (1 << 28)) != 0;
 
 		// Must do this with inline assembly as __get_cpuid is unreliable for level 7
 		// and __get_cpuid_count is not always available.
@@ -248,7 +251,8 @@ CpuID::CpuID() {
 		asm ("cpuid\n\t"
 		    : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
 		    : "0"(level), "2"(zero));
-		_avx2 = (ebx & (1 << 5)) != 0;
-		_avx512 = (ebx & (1 << 16)) != 0;
+		_avx2 = _avx && (ebx & (1 << 5)) != 0;
+		_avx512 = osAvx512 && (ebx & (1 << 16)) != 0;
+		_avx512ifma = _avx512 && (ebx & (1 << 21)) != 0;
 	}
 }
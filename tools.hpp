@@ -102,13 +102,15 @@ inline uint32_t toBEnd32(uint32_t n) {
 	return (uint32_t) tmp[3] | ((uint32_t) tmp[2]) << 8 | ((uint32_t) tmp[1]) << 16 | ((uint32_t) tmp[0]) << 24;
 }
 
+// The AVX and AVX-512 instruction sets are only reported as supported if the OS saves the corresponding registers
 class CpuID {
-	bool _avx, _avx2, _avx512;
+	bool _avx, _avx2, _avx512, _avx512ifma;
 public:
 	CpuID();
 	bool hasAVX() const {return _avx;}
 	bool hasAVX2() const {return _avx2;}
-	bool hasAVX512() const {return _avx512;}
+	bool hasAVX512() const {return _avx512;} // AVX-512 Foundation
+	bool hasAVX512IFMA() const {return _avx512ifma;}
 };
 
 #endif
@@ -2,22 +2,26 @@
 (c) 2014-2017 dave-andersen (http://www.cs.cmu.edu/~dga/)
 (c) 2017-2018 Pttn and contributors (https://github.com/Pttn/rieMiner) */
 
-/* Threadsafe blocking work queue implementation. Defined to be analogous to STL
-deque, please follow STL naming conventions for methods. */
+/* Threadsafe blocking work queue implementations. Defined to be analogous to STL
+deque, please follow STL naming conventions for methods.
+
+tsQueue is lock-free as long as it is neither empty nor full, and tsLockedQueue is
+the former std::deque behind a mutex, used instead if TSQUEUE_LOCKED is defined. */
 
 #ifndef HEADER_tsQueue_hpp
 #define HEADER_tsQueue_hpp
 
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <deque>
 
-template<class T, int maxSize> class tsQueue {
+template<class T, int maxSize> class tsLockedQueue {
 	std::deque<T> _q;
 	std::mutex _m;
 	std::condition_variable _cv, _cvFull;
-	
+
 	public:
 	// Blocks iff queue size >= maxSize
 	void push_back(T item) {
@@ -28,6 +32,16 @@ template<class T, int maxSize> class tsQueue {
 		_cv.notify_one();
 	}
 
+	// Pushes the item and returns true if the queue isn't full
+	// else returns false.
+	bool push_back_if_not_full(T item) {
+		std::lock_guard<std::mutex> lock(_m);
+		if (_q.size() >= maxSize) return false;
+		_q.push_back(item);
+		_cv.notify_one();
+		return true;
+	}
+
 	void push_front(T item) {
 		std::unique_lock<std::mutex> lock(_m);
 		while (_q.size() >= maxSize)
@@ -58,7 +72,7 @@ template<class T, int maxSize> class tsQueue {
 		_cvFull.notify_one();
 		return true;
 	}
-	
+
 	// Nonblocking - clears queue, returns number of items removed
 	typename std::deque<T>::size_type clear() {
 		std::unique_lock<std::mutex> lock(_m);
@@ -75,4 +89,179 @@ template<class T, int maxSize> class tsQueue {
 	}
 };
 
+// Bounded multi producer multi consumer ring buffer from Dmitry Vyukov. Each cell has a sequence number telling whether it is ready to be written
+// or read for the current lap, so the producers and consumers only contend on their own position with a compare and swap.
+template<class T, uint64_t capacity> class mpmcRing {
+	static_assert((capacity & (capacity - 1)) == 0, "The capacity must be a power of 2");
+	struct Cell {
+		std::atomic<uint64_t> sequence;
+		T data;
+	};
+	Cell *_cells;
+	char _pad0[64];
+	std::atomic<uint64_t> _enqueuePos;
+	char _pad1[64];
+	std::atomic<uint64_t> _dequeuePos;
+	char _pad2[64];
+
+	public:
+	mpmcRing() : _cells(new Cell[capacity]), _enqueuePos(0), _dequeuePos(0) {
+		for (uint64_t i(0) ; i < capacity ; i++) _cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+	~mpmcRing() {delete[] _cells;}
+	mpmcRing(const mpmcRing&) = delete;
+	mpmcRing& operator=(const mpmcRing&) = delete;
+
+	bool push(const T &item) {
+		uint64_t pos(_enqueuePos.load(std::memory_order_relaxed));
+		Cell *cell;
+		while (true) {
+			cell = &_cells[pos & (capacity - 1)];
+			const int64_t dif(int64_t(cell->sequence.load(std::memory_order_acquire)) - int64_t(pos));
+			if (dif == 0) {
+				if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			}
+			else if (dif < 0) return false; // Full
+			else pos = _enqueuePos.load(std::memory_order_relaxed);
+		}
+		cell->data = item;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T &item) {
+		uint64_t pos(_dequeuePos.load(std::memory_order_relaxed));
+		Cell *cell;
+		while (true) {
+			cell = &_cells[pos & (capacity - 1)];
+			const int64_t dif(int64_t(cell->sequence.load(std::memory_order_acquire)) - int64_t(pos + 1));
+			if (dif == 0) {
+				if (_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+			}
+			else if (dif < 0) return false; // Empty
+			else pos = _dequeuePos.load(std::memory_order_relaxed);
+		}
+		item = cell->data;
+		cell->sequence.store(pos + capacity, std::memory_order_release);
+		return true;
+	}
+
+	// Approximate if there are concurrent operations
+	uint64_t size() const {
+		const uint64_t dequeuePos(_dequeuePos.load(std::memory_order_relaxed)), enqueuePos(_enqueuePos.load(std::memory_order_relaxed));
+		return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+	}
+};
+
+constexpr uint64_t nextPowerOf2(uint64_t n, uint64_t p = 1) {return p >= n ? p : nextPowerOf2(n, 2*p);}
+
+// The capacity is maxSize rounded up to a power of 2. The items pushed to the front go to a second ring, which is popped first.
+// Unlike with tsLockedQueue, the items pushed to the front are popped in the order they were pushed (FIFO, not LIFO), so callers must only rely on them coming before the ones pushed to the back.
+// The threads only sleep on the condition variables if the queue is empty (or full), and are only notified if some are sleeping.
+template<class T, int maxSize> class tsLockFreeQueue {
+	// The producers waiting for room in a ring have their own condition variable, so a pop from the other ring does not wake them for nothing
+	struct Ring {
+		mpmcRing<T, nextPowerOf2(maxSize)> items;
+		std::condition_variable cvFull;
+		std::atomic<uint32_t> waitingFull{0};
+	};
+	Ring _back, _front;
+	std::mutex _m;
+	std::condition_variable _cv;
+	std::atomic<uint32_t> _waiting;
+
+	// Returns the ring the item was popped from, or NULL if the queue is empty
+	Ring* _tryPop(T &item) {
+		if (_front.items.pop(item)) return &_front;
+		if (_back.items.pop(item)) return &_back;
+		return NULL;
+	}
+
+	// The fence ensures that either the pushed or popped item is seen by a thread about to sleep, or this thread sees that it is sleeping
+	void _notify(std::atomic<uint32_t> &waiting, std::condition_variable &cv) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed) > 0) {
+			std::lock_guard<std::mutex> lock(_m);
+			cv.notify_one();
+		}
+	}
+
+	void _push(Ring &ring, const T &item) {
+		if (!ring.items.push(item)) {
+			std::unique_lock<std::mutex> lock(_m);
+			ring.waitingFull++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (!ring.items.push(item))
+				ring.cvFull.wait(lock);
+			ring.waitingFull--;
+		}
+		_notify(_waiting, _cv);
+	}
+
+	public:
+	tsLockFreeQueue() : _waiting(0) {}
+
+	// Blocks iff the ring is full
+	void push_back(T item) {
+		_push(_back, item);
+	}
+
+	bool push_back_if_not_full(T item) {
+		if (!_back.items.push(item)) return false;
+		_notify(_waiting, _cv);
+		return true;
+	}
+
+	// Blocks iff the front ring is full. The item is popped before the ones pushed to the back, but after the ones previously pushed to the front
+	void push_front(T item) {
+		_push(_front, item);
+	}
+
+	// Blocks until an item is available to pop
+	T pop_front() {
+		T item;
+		Ring *ring(_tryPop(item));
+		if (ring == NULL) {
+			std::unique_lock<std::mutex> lock(_m);
+			_waiting++;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while ((ring = _tryPop(item)) == NULL)
+				_cv.wait(lock);
+			_waiting--;
+		}
+		_notify(ring->waitingFull, ring->cvFull);
+		return item;
+	}
+
+	bool pop_front_if_not_empty(T& item) {
+		Ring *ring(_tryPop(item));
+		if (ring == NULL) return false;
+		_notify(ring->waitingFull, ring->cvFull);
+		return true;
+	}
+
+	// Nonblocking - clears queue, returns number of items removed
+	uint64_t clear() {
+		T item;
+		uint64_t s(0);
+		while (_tryPop(item) != NULL) s++;
+		if (s > 0) {
+			std::lock_guard<std::mutex> lock(_m);
+			_front.cvFull.notify_all();
+			_back.cvFull.notify_all();
+		}
+		return s;
+	}
+
+	uint32_t size() {
+		return _front.items.size() + _back.items.size();
+	}
+};
+
+#ifdef TSQUEUE_LOCKED
+template<class T, int maxSize> using tsQueue = tsLockedQueue<T, maxSize>;
+#else
+template<class T, int maxSize> using tsQueue = tsLockFreeQueue<T, maxSize>;
+#endif
+
 #endif